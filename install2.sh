@@ -52,6 +52,16 @@ rm openMVS/libs/MVS/SceneDensify.cpp
 cp patches/openMVS/libs/MVS/SceneDensify.cpp openMVS/libs/MVS/SceneDensify.cpp
 rm openMVS/apps/DensifyPointCloud/DensifyPointCloud.cpp
 cp patches/openMVS/apps/DensifyPointCloud/DensifyPointCloud.cpp openMVS/apps/DensifyPointCloud/DensifyPointCloud.cpp
+#expose the chunked mesh reconstruction in the upstream ReconstructMesh app
+sed -i \
+	-e 's/^namespace OPT {$/&\nunsigned nMaxChunkPoints;\nfloat fChunkOverlap;/' \
+	-e 's/^\([[:space:]]*\)("quality-factor".*$/&\n\1("max-chunk-points", boost::program_options::value(\&OPT::nMaxChunkPoints)->default_value(0), "split the point-cloud in chunks of at most this number of points, reconstructed independently and stitched, to bound the peak memory; holes left along the seams are closed by --close-holes (0 - disabled)")\n\1("chunk-overlap", boost::program_options::value(\&OPT::fChunkOverlap)->default_value(0.1f), "margin around each chunk, as a ratio of its size, from which the points are also used")/' \
+	-e 's/scene\.ReconstructMesh(\([^)]*\))/scene.ReconstructMeshChunks(OPT::nMaxChunkPoints, OPT::fChunkOverlap, [\&](MVS::Scene\& chunk) { return chunk.ReconstructMesh(\1); })/' \
+	openMVS/apps/ReconstructMesh/ReconstructMesh.cpp
+if [ "$(grep -c 'nMaxChunkPoints' openMVS/apps/ReconstructMesh/ReconstructMesh.cpp)" -lt 3 ]; then
+	echo "error: can not expose the chunk options in ReconstructMesh.cpp"
+	exit 1
+fi
 
 ##Revert https://github.com/cdcseacave/openMVS/commit/cd73b4c39147fd26567c603a45d22b0c7fef33cb
 ##I get ...
@@ -50,11 +50,29 @@ String strInputFileName;
 String strOutputFileName;
 String strMeshFileName;
 String strDenseConfigFileName;
+String strFuseImages;
+String strImageRange;
+String strShard;
+String strMergeSubscenes;
+float fMergeVoxelSize;
 float fMaxSubsceneArea;
+float fMaxSubsceneMemory;
+int nSubsceneDensify;
+float fSubsceneMemory;
 float fSampleMesh;
 int nFusionMode;
+int nWorker;
+float fWorkerLockTimeout;
 int thFilterPointCloud;
 int nExportNumViews;
+int nExportFusionStats;
+int nSelectViews;
+int nPlan;
+unsigned nNormalsNeighbors;
+unsigned nOutliersNeighbors;
+float fOutliersStdDev;
+float fOutliersRadius;
+unsigned nOutliersMinNeighbors;
 int nArchiveType;
 int nProcessPriority;
 unsigned nMaxThreads;
@@ -101,6 +119,10 @@ bool Initialize(size_t argc, LPCTSTR* argv)
 	unsigned nEstimateColors;
 	unsigned nEstimateNormals;
 	int nIgnoreMaskLabel;
+	float fFusionSpacing;
+	unsigned nFusionMaxPoints;
+	float fViewMinGain;
+	float fViewTimeBudget;
 	boost::program_options::options_description config("Densify options");
 	config.add_options()
 		("input-file,i", boost::program_options::value<std::string>(&OPT::strInputFileName), "input filename containing camera poses and image list")
@@ -112,15 +134,37 @@ bool Initialize(size_t argc, LPCTSTR* argv)
 		("max-resolution", boost::program_options::value(&nMaxResolution)->default_value(3200), "do not scale images higher than this resolution")
 		("min-resolution", boost::program_options::value(&nMinResolution)->default_value(640), "do not scale images lower than this resolution")
 		("number-views", boost::program_options::value(&nNumViews)->default_value(5), "number of views used for depth-map estimation (0 - all neighbor views available)")
+		("views-min-gain", boost::program_options::value(&fViewMinGain)->default_value(0.f), "adaptively stop adding views for depth-map estimation once a new view increases the covered area and the baseline spread by less than this ratio (0 - disabled)")
+		("views-time-budget", boost::program_options::value(&fViewTimeBudget)->default_value(0.f), "adaptively stop adding views for depth-map estimation once the predicted estimation time per image exceeds this many seconds (0 - disabled)")
 		("number-views-fuse", boost::program_options::value(&nMinViewsFuse)->default_value(3), "minimum number of images that agrees with an estimate during fusion in order to consider it inlier (<2 - only merge depth-maps)")
 		("ignore-mask-label", boost::program_options::value(&nIgnoreMaskLabel)->default_value(-1), "integer value for the label to ignore in the segmentation mask (<0 - disabled)")
 		("estimate-colors", boost::program_options::value(&nEstimateColors)->default_value(2), "estimate the colors for the dense point-cloud (0 - disabled, 1 - final, 2 - estimate)")
 		("estimate-normals", boost::program_options::value(&nEstimateNormals)->default_value(2), "estimate the normals for the dense point-cloud (0 - disabled, 1 - final, 2 - estimate)")
 		("sub-scene-area", boost::program_options::value(&OPT::fMaxSubsceneArea)->default_value(0.f), "split the scene in sub-scenes such that each sub-scene surface does not exceed the given maximum sampling area (0 - disabled)")
+		("max-memory", boost::program_options::value(&OPT::fMaxSubsceneMemory)->default_value(0.f), "split the scene in sub-scenes such that densifying each sub-scene is predicted to fit the given memory budget in GB, using a rough fixed per-pixel cost model (not calibrated, keep a safety margin); if --sub-scene-area is not given, the maximum area is derived from it; the depth-maps must be estimated first (--fusion-mode 1) (0 - disabled)")
+		("sub-scene-densify", boost::program_options::value(&OPT::nSubsceneDensify)->default_value(0), "densify the sub-scenes in this process and merge the fused point-clouds, instead of exporting them (0 - export, 1 - densify)")
+		("sub-scene-memory", boost::program_options::value(&OPT::fSubsceneMemory)->default_value(0.f), "memory budget in GB for fusing several sub-scenes concurrently (0 - one sub-scene at a time)")
+		("merge-sub-scenes", boost::program_options::value<std::string>(&OPT::strMergeSubscenes), "merge the dense point-clouds of the given sub-scenes (ex. \"scene_0000_dense.mvs,scene_0001_dense.mvs\"), densified independently after being exported by --sub-scene-area, into the input scene")
+		("merge-voxel-size", boost::program_options::value(&OPT::fMergeVoxelSize)->default_value(0.f), "while merging sub-scenes, drop the points falling in a voxel of this size already occupied by a previous sub-scene (0 - keep only the points inside each sub-scene region)")
 		("sample-mesh", boost::program_options::value(&OPT::fSampleMesh)->default_value(0.f), "uniformly samples points on a mesh (0 - disabled, <0 - number of points, >0 - sample density per square unit)")
 		("fusion-mode", boost::program_options::value(&OPT::nFusionMode)->default_value(0), "depth map fusion mode (-2 - fuse disparity-maps, -1 - export disparity-maps only, 0 - depth-maps & fusion, 1 - export depth-maps only)")
 		("filter-point-cloud", boost::program_options::value(&OPT::thFilterPointCloud)->default_value(0), "filter dense point-cloud based on visibility (0 - disabled)")
 		("export-number-views", boost::program_options::value(&OPT::nExportNumViews)->default_value(0), "export points with >= number of views (0 - disabled)")
+		("fusion-spacing", boost::program_options::value(&fFusionSpacing)->default_value(0.f), "minimum distance between the fused points, keeping only the best sample in each cell of this size (0 - disabled)")
+		("fusion-max-points", boost::program_options::value(&nFusionMaxPoints)->default_value(0), "maximum number of fused points, increasing the fusion spacing as needed (0 - disabled, else at least 1000)")
+		("image-range", boost::program_options::value<std::string>(&OPT::strImageRange), "estimate only the depth-maps of the images in the given index range (ex. \"100:200\", end excluded), still loading all images as neighbors; valid only with --fusion-mode 1 or -1, the depth-maps being filtered and fused by a later run")
+		("shard", boost::program_options::value<std::string>(&OPT::strShard), "estimate only the depth-maps of the given shard out of the images split in equal ranges (ex. \"2/8\", first shard 0); same as --image-range")
+		("worker", boost::program_options::value(&OPT::nWorker)->default_value(0), "estimate the depth-maps cooperatively with other processes sharing the working folder, by claiming them through lock-files (0 - disabled, 1 - estimate the claimed depth-maps and exit, 2 - also wait for all depth-maps and let the first worker fuse them, marking the working folder with fuse.done)")
+		("worker-lock-timeout", boost::program_options::value(&OPT::fWorkerLockTimeout)->default_value(3600.f), "seconds after which the lock of a depth-map not refreshed by its worker is considered abandoned and reclaimed; a running worker touches its locks every quarter of this time (0 - never)")
+		("plan", boost::program_options::value(&OPT::nPlan)->default_value(0), "only print the predicted peak memory, disk and time of each densification stage with the current options, without estimating anything (0 - disabled, 1 - enabled)")
+		("select-views", boost::program_options::value(&OPT::nSelectViews)->default_value(0), "select the neighbor views of all images in parallel before densifying, and store them with the output scene (0 - disabled, 1 - enabled, 2 - only select the views and save the scene)")
+		("fuse-images", boost::program_options::value<std::string>(&OPT::strFuseImages), "fuse only the depth-maps of the new images with the given IDs (ex. \"3,7,10-15\") into the input dense point-cloud")
+		("remove-outliers-neighbors", boost::program_options::value(&OPT::nOutliersNeighbors)->default_value(0), "remove the points whose mean distance to this number of nearest neighbors is too large (0 - disabled)")
+		("remove-outliers-std-dev", boost::program_options::value(&OPT::fOutliersStdDev)->default_value(2.f), "statistical outliers threshold, as the number of standard deviations above the mean neighbor distance")
+		("remove-outliers-radius", boost::program_options::value(&OPT::fOutliersRadius)->default_value(0.f), "remove the points having too few neighbors inside this radius (0 - disabled)")
+		("remove-outliers-min-neighbors", boost::program_options::value(&OPT::nOutliersMinNeighbors)->default_value(4), "minimum number of neighbors inside the radius for a point to be kept")
+		("normals-neighbors", boost::program_options::value(&OPT::nNormalsNeighbors)->default_value(0), "estimate the normals of the dense point-cloud by fitting a plane to this number of nearest neighbors, instead of estimating them while fusing; the normals of an already fused point-cloud are kept (0 - disabled)")
+		("export-fusion-stats", boost::program_options::value(&OPT::nExportFusionStats)->default_value(0), "export per image depth-map fusion counters next to the output (0 - disabled, 1 - CSV, 2 - JSON)")
 		;
 
 	// hidden options, allowed both on command line and
@@ -180,6 +224,16 @@ bool Initialize(size_t argc, LPCTSTR* argv)
 	if (OPT::strOutputFileName.IsEmpty())
 		OPT::strOutputFileName = Util::getFileFullName(OPT::strInputFileName) + _T("_dense.mvs");
 
+	// validate the fusion decimation options
+	if (fFusionSpacing < 0) {
+		VERBOSE("error: invalid fusion spacing %g", fFusionSpacing);
+		return false;
+	}
+	if (nFusionMaxPoints > 0 && nFusionMaxPoints < 1000) {
+		VERBOSE("error: fusion points budget %u too small (at least 1000 points)", nFusionMaxPoints);
+		return false;
+	}
+
 	// init dense options
 	if (!OPT::strDenseConfigFileName.IsEmpty())
 		OPT::strDenseConfigFileName = MAKE_PATH_SAFE(OPT::strDenseConfigFileName);
@@ -193,10 +247,17 @@ bool Initialize(size_t argc, LPCTSTR* argv)
 	OPTDENSE::nMaxResolution = nMaxResolution;
 	OPTDENSE::nMinResolution = nMinResolution;
 	OPTDENSE::nNumViews = nNumViews;
+	OPTDENSE::fViewMinGain = fViewMinGain;
+	OPTDENSE::fViewTimeBudget = fViewTimeBudget;
 	OPTDENSE::nMinViewsFuse = nMinViewsFuse;
 	OPTDENSE::nEstimateColors = nEstimateColors;
-	OPTDENSE::nEstimateNormals = nEstimateNormals;
+	// the neighbors post-step replaces the normals estimated while fusing, so do not pay for those
+	OPTDENSE::nEstimateNormals = (OPT::nNormalsNeighbors > 0 ? 0 : nEstimateNormals);
 	OPTDENSE::nIgnoreMaskLabel = nIgnoreMaskLabel;
+	OPTDENSE::fFusionSpacing = fFusionSpacing;
+	OPTDENSE::nFusionMaxPoints = nFusionMaxPoints;
+	if (OPT::nExportFusionStats > 0)
+		OPTDENSE::strFusionStatsFileName = MAKE_PATH_SAFE(Util::getFileFullName(OPT::strOutputFileName)) + (OPT::nExportFusionStats > 1 ? _T("_fusion.json") : _T("_fusion.csv"));
 	if (!bValidConfig && !OPT::strDenseConfigFileName.IsEmpty())
 		OPTDENSE::oConfig.Save(OPT::strDenseConfigFileName);
 
@@ -216,6 +277,50 @@ bool Initialize(size_t argc, LPCTSTR* argv)
 	return true;
 }
 
+// parse a list of image IDs and ranges, ex. "3,7,10-15",
+// and map them to the indices of the images in the scene
+bool ParseImageList(const Scene& scene, const String& strList, IIndexArr& images)
+{
+	std::unordered_map<uint32_t,IIndex> mapImageIDs(scene.images.size());
+	uint32_t maxID(0);
+	FOREACH(idxImage, scene.images) {
+		const uint32_t ID(scene.images[idxImage].ID);
+		mapImageIDs.emplace(ID, idxImage);
+		maxID = MAXF(maxID, ID);
+	}
+	std::vector<IIndex> indices;
+	std::istringstream ss(strList);
+	std::string token;
+	while (std::getline(ss, token, ',')) {
+		unsigned first, last;
+		const int nRead(sscanf(token.c_str(), "%u-%u", &first, &last));
+		if (nRead < 1)
+			return false;
+		if (nRead == 1) {
+			const auto itImage(mapImageIDs.find(first));
+			if (itImage == mapImageIDs.end()) {
+				VERBOSE("error: unknown image ID %u", first);
+				return false;
+			}
+			indices.emplace_back(itImage->second);
+			continue;
+		}
+		if (first > last)
+			return false;
+		// no image has an ID past the largest one, so bound the range before expanding it
+		last = MINF(last, maxID);
+		for (uint64_t ID=first; ID<=last; ++ID) {
+			const auto itImage(mapImageIDs.find((uint32_t)ID));
+			if (itImage != mapImageIDs.end())
+				indices.emplace_back(itImage->second);
+		}
+	}
+	std::sort(indices.begin(), indices.end());
+	indices.erase(std::unique(indices.begin(), indices.end()), indices.end());
+	images.CopyOf(indices.data(), (IIndex)indices.size());
+	return !images.IsEmpty();
+}
+
 // finalize application instance
 void Finalize()
 {
@@ -264,14 +369,69 @@ int main(int argc, LPCTSTR* argv)
 		VERBOSE("error: empty initial point-cloud");
 		return EXIT_FAILURE;
 	}
-	if (OPT::fMaxSubsceneArea > 0) {
-		// split the scene in sub-scenes by maximum sampling area
-		Scene::ImagesChunkArr chunks;
-		scene.Split(chunks, OPT::fMaxSubsceneArea);
-		scene.ExportChunks(chunks, Util::getFilePath(MAKE_PATH_SAFE(OPT::strOutputFileName)), (ARCHIVE_TYPE)OPT::nArchiveType);
+	if (OPT::nPlan) {
+		// dry-run: predict the resources needed to densify the scene
+		scene.PlanDenseReconstruction();
 		Finalize();
 		return EXIT_SUCCESS;
 	}
+	if (!OPT::strImageRange.empty() || !OPT::strShard.empty()) {
+		// restrict the depth-maps to estimate to a range of images
+		unsigned nBegin, nEnd;
+		if (!OPT::strShard.empty()) {
+			unsigned nShard, nShards;
+			if (sscanf(OPT::strShard.c_str(), "%u/%u", &nShard, &nShards) != 2 || nShard >= nShards) {
+				VERBOSE("error: invalid shard '%s'", OPT::strShard.c_str());
+				return EXIT_FAILURE;
+			}
+			nBegin = (unsigned)((uint64_t)scene.images.size()*nShard/nShards);
+			nEnd = (unsigned)((uint64_t)scene.images.size()*(nShard+1)/nShards);
+		} else
+		if (sscanf(OPT::strImageRange.c_str(), "%u:%u", &nBegin, &nEnd) != 2) {
+			VERBOSE("error: invalid image range '%s'", OPT::strImageRange.c_str());
+			return EXIT_FAILURE;
+		}
+		nEnd = MINF(nEnd, (unsigned)scene.images.size());
+		if (nBegin >= nEnd || ABS(OPT::nFusionMode) != 1) {
+			VERBOSE("error: the image range must be non-empty and used only to export depth-maps (--fusion-mode 1 or -1)");
+			return EXIT_FAILURE;
+		}
+		OPTDENSE::nImageRangeBegin = nBegin;
+		OPTDENSE::nImageRangeEnd = nEnd;
+		VERBOSE("Estimating the depth-maps of images %u to %u", nBegin, nEnd-1);
+	}
+	Scene::ImagesChunkArr chunks;
+	if (OPT::fMaxSubsceneArea > 0 || OPT::fMaxSubsceneMemory > 0) {
+		// the split samples the estimated depth-maps, so they must exist already
+		IIndex nImages(0), nDepthMaps(0);
+		for (const Image& imageData: scene.images) {
+			if (!imageData.IsValid())
+				continue;
+			++nImages;
+			if (File::access(ComposeDepthFilePath(imageData.ID, "dmap")))
+				++nDepthMaps;
+		}
+		if (nDepthMaps == 0) {
+			VERBOSE("error: the scene can not be split in sub-scenes before its depth-maps are estimated (run first with --fusion-mode 1)");
+			return EXIT_FAILURE;
+		}
+		if (nDepthMaps < nImages)
+			VERBOSE("warning: only %u out of %u images have a depth-map, the others are ignored while splitting the scene (run first with --fusion-mode 1)", nDepthMaps, nImages);
+		// split the scene in sub-scenes by maximum sampling area and/or memory budget
+		const unsigned nChunks(scene.Split(chunks, MAXF(OPT::fMaxSubsceneArea, 0.f), 8, (size_t)(OPT::fMaxSubsceneMemory*1024*1024*1024)));
+		FOREACH(c, chunks)
+			VERBOSE("Sub-scene %u: %u images, predicted peak memory %s", c, chunks[c].images.size(), Util::formatBytes(scene.EstimateChunkMemory(chunks[c])).c_str());
+		if (OPT::nSubsceneDensify == 0) {
+			scene.ExportChunks(chunks, Util::getFilePath(MAKE_PATH_SAFE(OPT::strOutputFileName)), (ARCHIVE_TYPE)OPT::nArchiveType);
+			Finalize();
+			return EXIT_SUCCESS;
+		}
+		if (nChunks == 0) {
+			// the whole scene fits in a single sub-scene
+			VERBOSE("The scene is not split: it fits in a single sub-scene, densified at once");
+			chunks.Release();
+		}
+	}
 	if (OPT::thFilterPointCloud < 0) {
 		// filter point-cloud based on camera-point visibility intersections
 		scene.PointCloudFilter(OPT::thFilterPointCloud);
@@ -288,6 +448,83 @@ int main(int argc, LPCTSTR* argv)
 		Finalize();
 		return EXIT_SUCCESS;
 	}
+	if (OPT::nSelectViews > 0) {
+		// compute the view graph once, so the following runs can skip the view selection
+		const unsigned nMinPointViews(OPTDENSE::nMinViewsTrustPoint>1?OPTDENSE::nMinViewsTrustPoint:2);
+		scene.SelectNeighborViews(OPTDENSE::nMinViews, nMinPointViews, FD2R(OPTDENSE::fOptimAngle));
+		if (OPT::nSelectViews > 1) {
+			// the neighbor views are stored only by the native archive types
+			const ARCHIVE_TYPE type((ARCHIVE_TYPE)OPT::nArchiveType == ARCHIVE_MVS ? ARCHIVE_DEFAULT : (ARCHIVE_TYPE)OPT::nArchiveType);
+			scene.Save(MAKE_PATH_SAFE(Util::getFileFullName(OPT::strOutputFileName))+_T("_views.mvs"), type);
+			Finalize();
+			return EXIT_SUCCESS;
+		}
+	}
+	if (!OPT::strMergeSubscenes.IsEmpty()) {
+		// merge the independently densified sub-scenes, one at a time
+		StringArr fileNames;
+		std::istringstream ss(OPT::strMergeSubscenes);
+		std::string token;
+		while (std::getline(ss, token, ','))
+			if (!token.empty())
+				fileNames.emplace_back(MAKE_PATH_SAFE(String(token)));
+		TD_TIMER_START();
+		if (!scene.MergeChunks(fileNames, OPT::fMergeVoxelSize))
+			return EXIT_FAILURE;
+		VERBOSE("Merging sub-scenes completed: %u sub-scenes, %u points (%s)", fileNames.size(), scene.pointcloud.GetSize(), TD_TIMER_GET_FMT().c_str());
+	} else
+	if (!chunks.IsEmpty()) {
+		// densify the sub-scenes in this process and merge them into the final point-cloud
+		TD_TIMER_START();
+		if (!scene.DenseReconstructionChunks(chunks, (size_t)(OPT::fSubsceneMemory*1024*1024*1024)))
+			return EXIT_FAILURE;
+		VERBOSE("Densifying sub-scenes completed: %u chunks, %u points (%s)", chunks.size(), scene.pointcloud.GetSize(), TD_TIMER_GET_FMT().c_str());
+	} else
+	if (!OPT::strFuseImages.IsEmpty()) {
+		// fuse the depth-maps of the new images into the existing dense point-cloud
+		IIndexArr newImages;
+		if (!ParseImageList(scene, OPT::strFuseImages, newImages)) {
+			VERBOSE("error: invalid image list '%s'", OPT::strFuseImages.c_str());
+			return EXIT_FAILURE;
+		}
+		TD_TIMER_START();
+		if (!scene.DenseFuseNewImages(newImages))
+			return EXIT_FAILURE;
+		VERBOSE("Incremental fusion completed: %u points (%s)", scene.pointcloud.GetSize(), TD_TIMER_GET_FMT().c_str());
+	} else
+	if (OPT::nWorker > 0) {
+		// cooperate with other worker processes in estimating the depth-maps
+		TD_TIMER_START();
+		const int nFused(scene.DenseReconstructionWorker(OPT::nWorker > 1, OPT::fWorkerLockTimeout));
+		if (nFused < 0)
+			return EXIT_FAILURE;
+		if (nFused == 0) {
+			VERBOSE("Worker completed (%s)", TD_TIMER_GET_FMT().c_str());
+			Finalize();
+			return EXIT_SUCCESS;
+		}
+		VERBOSE("Densifying point-cloud completed: %u points (%s)", scene.pointcloud.GetSize(), TD_TIMER_GET_FMT().c_str());
+	} else
+	if ((ARCHIVE_TYPE)OPT::nArchiveType != ARCHIVE_MVS) {
+		TD_TIMER_START();
+		if (!scene.DenseReconstruction(OPT::nFusionMode)) {
+			if (ABS(OPT::nFusionMode) != 1)
+				return EXIT_FAILURE;
+			VERBOSE("Depth-maps estimated (%s)", TD_TIMER_GET_FMT().c_str());
+			Finalize();
+			return EXIT_SUCCESS;
+		}
+		VERBOSE("Densifying point-cloud completed: %u points (%s)", scene.pointcloud.GetSize(), TD_TIMER_GET_FMT().c_str());
+	}
+
+	if (OPT::nOutliersNeighbors > 0 || OPT::fOutliersRadius > 0) {
+		// remove statistical and/or radius outliers
+		scene.PointCloudRemoveOutliers(OPT::nOutliersNeighbors, OPT::fOutliersStdDev, OPT::fOutliersRadius, OPT::nOutliersMinNeighbors);
+	}
+	if (OPT::nNormalsNeighbors > 0 && scene.pointcloud.normals.IsEmpty()) {
+		// estimate the normals from the point neighborhoods (not estimated while fusing)
+		scene.PointCloudEstimateNormals(MAXF(OPT::nNormalsNeighbors, 3u));
+	}
 
 	// save the final mesh
 	const String baseFileName(MAKE_PATH_SAFE(Util::getFileFullName(OPT::strOutputFileName)));
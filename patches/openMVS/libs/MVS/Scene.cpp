@@ -33,6 +33,7 @@
 #include "Scene.h"
 #define _USE_OPENCV
 #include "Interface.h"
+#include <bitset>
 
 using namespace MVS;
 
@@ -56,6 +57,7 @@ void Scene::Release()
 	images.Release();
 	pointcloud.Release();
 	mesh.Release();
+	InvalidateImagePoints();
 }
 
 bool Scene::IsEmpty() const
@@ -72,6 +74,39 @@ bool Scene::ImagesHaveNeighbors() const
 }
 
 
+// build the image to points inverted index of the current point-cloud
+void Scene::IndexImagePoints()
+{
+	imagePointsOffsets.Resize(images.GetSize()+1);
+	imagePointsOffsets.Memset(0);
+	imagePoints.Release();
+	if (pointcloud.pointViews.GetSize() != pointcloud.points.GetSize())
+		return;
+	for (const PointCloud::ViewArr& views: pointcloud.pointViews)
+		for (PointCloud::View idxImage: views)
+			++imagePointsOffsets[idxImage+1];
+	FOREACH(idxImage, images)
+		imagePointsOffsets[idxImage+1] += imagePointsOffsets[idxImage];
+	imagePoints.Resize(imagePointsOffsets.Last());
+	UnsignedArr counts(images.GetSize());
+	counts.Memset(0);
+	FOREACH(idxPoint, pointcloud.points)
+		for (PointCloud::View idxImage: pointcloud.pointViews[idxPoint])
+			imagePoints[imagePointsOffsets[idxImage]+(counts[idxImage]++)] = idxPoint;
+}
+// drop the image to points inverted index, to be called whenever the point-cloud is replaced or edited
+void Scene::InvalidateImagePoints()
+{
+	imagePointsOffsets.Release();
+	imagePoints.Release();
+}
+// check if the image to points inverted index was built for the current point-cloud
+bool Scene::IsImagePointsIndexed() const
+{
+	return imagePointsOffsets.GetSize() == images.GetSize()+1;
+}
+
+
 bool Scene::LoadInterface(const String & fileName)
 {
 	TD_TIMER_STARTD();
@@ -158,6 +193,7 @@ bool Scene::LoadInterface(const String & fileName)
 		return false;
 
 	// import 3D points
+	InvalidateImagePoints();
 	if (!obj.vertices.empty()) {
 		bool bValidWeights(false);
 		pointcloud.points.Resize(obj.vertices.size());
@@ -420,8 +456,10 @@ bool Scene::Import(const String& fileName)
 		}
 		if (nVertices && nFaces)
 			return mesh.Load(fileName);
-		if (nVertices)
+		if (nVertices) {
+			InvalidateImagePoints();
 			return pointcloud.Load(fileName);
+		}
 	}
 	return false;
 } // Import
@@ -536,6 +574,7 @@ void Scene::SampleMeshWithVisibility(unsigned maxResolution)
 	ASSERT(!mesh.IsEmpty());
 	const Depth thFrontDepth(0.985f);
 	pointcloud.Release();
+	InvalidateImagePoints();
 	pointcloud.points.resize(mesh.vertices.size());
 	pointcloud.pointViews.resize(mesh.vertices.size());
 	#ifdef SCENE_USE_OPENMP
@@ -612,11 +651,15 @@ bool Scene::SelectNeighborViews(uint32_t ID, IndexArr& points, unsigned nMinView
 	unsigned nPoints = 0;
 	imageData.avgDepth = 0;
 	const float sigmaAngle(-1.f/(2.f*SQUARE(fOptimAngle*1.3f)));
-	FOREACH(idx, pointcloud.points) {
+	// visit only the points seen by the reference image
+	if (!IsImagePointsIndexed())
+		IndexImagePoints(); // not thread-safe, normally the index is built before the parallel view selection
+	const PointCloud::Index* const pPointsEnd(imagePoints.Begin()+imagePointsOffsets[ID+1]);
+	for (const PointCloud::Index* pIdx=imagePoints.Begin()+imagePointsOffsets[ID]; pIdx!=pPointsEnd; ++pIdx) {
+		const PointCloud::Index idx(*pIdx);
 		const PointCloud::ViewArr& views = pointcloud.pointViews[idx];
 		ASSERT(views.IsSorted());
-		if (views.FindFirst(ID) == PointCloud::ViewArr::NO_INDEX)
-			continue;
+		ASSERT(views.FindFirst(ID) != PointCloud::ViewArr::NO_INDEX);
 		// store this point
 		const PointCloud::Point& point = pointcloud.points[idx];
 		if (views.GetSize() >= nMinPointViews)
@@ -652,8 +695,39 @@ bool Scene::SelectNeighborViews(uint32_t ID, IndexArr& points, unsigned nMinView
 	imageData.avgDepth /= nPoints;
 	ASSERT(nPoints > 3);
 
+	// project the points seen by the reference image in each neighbor image,
+	// and mark for each neighbor the cells of a coarse grid over the reference image
+	// covered by the projections inside both images (same grid as ComputeCoveredArea<float,2,16,false>)
+	enum { COVERAGE_GRID = 16 };
+	typedef std::bitset<COVERAGE_GRID*COVERAGE_GRID> CoverageMask;
+	const Point2f boundsA(imageData.GetSize());
+	const Point2f cellScaleA(float(COVERAGE_GRID)/boundsA.x, float(COVERAGE_GRID)/boundsA.y);
+	cList<CoverageMask> neighborMasks(images.GetSize());
+	for (uint32_t idx: points) {
+		const PointCloud::ViewArr& views = pointcloud.pointViews[idx];
+		const PointCloud::Point& point = pointcloud.points[idx];
+		const Point2f ptA(imageData.camera.ProjectPointP(point));
+		if (!imageData.camera.IsInside(ptA, boundsA))
+			continue;
+		const int cellX(MINF(MAXF(FLOOR2INT(ptA.x*cellScaleA.x), 0), (int)COVERAGE_GRID-1));
+		const int cellY(MINF(MAXF(FLOOR2INT(ptA.y*cellScaleA.y), 0), (int)COVERAGE_GRID-1));
+		const size_t cell((size_t)(cellY*COVERAGE_GRID+cellX));
+		for (const PointCloud::View& IDB: views) {
+			if (IDB == ID || scores[IDB].points < 3)
+				continue;
+			CoverageMask& mask = neighborMasks[IDB];
+			if (mask.test(cell))
+				continue; // no need to project, the cell is already covered
+			const Image& imageDataB = images[IDB];
+			if (!imageDataB.IsValid())
+				continue;
+			const Point2f ptB(imageDataB.camera.ProjectPointP(point));
+			if (imageDataB.camera.IsInside(ptB, Point2f(imageDataB.GetSize())))
+				mask.set(cell);
+		}
+	}
+
 	// select best neighborViews
-	Point2fArr projs(0, points.GetSize());
 	FOREACH(IDB, images) {
 		const Image& imageDataB = images[IDB];
 		if (!imageDataB.IsValid())
@@ -663,26 +737,10 @@ bool Scene::SelectNeighborViews(uint32_t ID, IndexArr& points, unsigned nMinView
 			continue;
 		ASSERT(ID != IDB);
 		// compute how well the matched features are spread out (image covered area)
-		const Point2f boundsA(imageData.GetSize());
-		const Point2f boundsB(imageDataB.GetSize());
-		ASSERT(projs.IsEmpty());
-		for (uint32_t idx: points) {
-			const PointCloud::ViewArr& views = pointcloud.pointViews[idx];
-			ASSERT(views.IsSorted());
-			ASSERT(views.FindFirst(ID) != PointCloud::ViewArr::NO_INDEX);
-			if (views.FindFirst(IDB) == PointCloud::ViewArr::NO_INDEX)
-				continue;
-			const PointCloud::Point& point = pointcloud.points[idx];
-			Point2f& ptA = projs.AddConstruct(imageData.camera.ProjectPointP(point));
-			Point2f ptB = imageDataB.camera.ProjectPointP(point);
-			if (!imageData.camera.IsInside(ptA, boundsA) || !imageDataB.camera.IsInside(ptB, boundsB))
-				projs.RemoveLast();
-		}
-		ASSERT(projs.GetSize() <= score.points);
-		if (projs.IsEmpty())
+		const CoverageMask& mask = neighborMasks[IDB];
+		if (mask.none())
 			continue;
-		const float area(ComputeCoveredArea<float,2,16,false>((const float*)projs.Begin(), projs.GetSize(), boundsA.ptr()));
-		projs.Empty();
+		const float area(float(mask.count())/float(COVERAGE_GRID*COVERAGE_GRID));
 		// store image score
 		ViewScore& neighbor = neighbors.AddEmpty();
 		neighbor.idx.ID = IDB;
@@ -708,6 +766,43 @@ bool Scene::SelectNeighborViews(uint32_t ID, IndexArr& points, unsigned nMinView
 	}
 	return true;
 } // SelectNeighborViews
+
+// compute the neighbor views of all valid images that do not have them yet (the view graph);
+// the images are processed in parallel, as each one writes only its own neighbors;
+// returns the number of images with valid neighbor views
+unsigned Scene::SelectNeighborViews(unsigned nMinViews, unsigned nMinPointViews, float fOptimAngle)
+{
+	TD_TIMER_STARTD();
+	// the index must be built before accessing it in parallel
+	if (!IsImagePointsIndexed())
+		IndexImagePoints();
+	Util::Progress progress(_T("Selected views"), images.size());
+	volatile Thread::safe_t nValidImages(0);
+	#ifdef SCENE_USE_OPENMP
+	#pragma omp parallel for schedule(dynamic)
+	for (int64_t _ID=0; _ID<images.size(); ++_ID) {
+		const IIndex ID(static_cast<IIndex>(_ID));
+	#else
+	FOREACH(ID, images) {
+	#endif
+		++progress;
+		Image& imageData = images[ID];
+		if (!imageData.IsValid())
+			continue;
+		if (imageData.neighbors.IsEmpty()) {
+			IndexArr points;
+			if (!SelectNeighborViews(ID, points, nMinViews, nMinPointViews, fOptimAngle)) {
+				// leave the image without neighbors, so it is not mistaken later as selected
+				imageData.neighbors.Release();
+				continue;
+			}
+		}
+		Thread::safeInc(nValidImages);
+	}
+	progress.close();
+	DEBUG_EXTRA("Neighbor views selected for %u/%u images (%s)", (unsigned)nValidImages, nCalibratedImages, TD_TIMER_GET_FMT().c_str());
+	return (unsigned)nValidImages;
+} // SelectNeighborViews
 /*----------------------------------------------------------------*/
 
 // keep only the best neighbors for the reference image
@@ -796,6 +891,83 @@ bool Scene::ExportCamerasMLP(const String& fileName, const String& fileNameScene
 /*----------------------------------------------------------------*/
 
 
+namespace {
+// sample every depthMapStep-th row and column of the depth-map stored in the given file,
+// reading from disk only the sampled rows of the depth-map;
+// returns the 3D points and their footprint area
+typedef cList<Point3f::EVec,const Point3f::EVec&,0,4096,uint32_t> DepthSamples;
+bool SampleDepthMapFile(const String& fileName, const Image& imageData, const PlatformArr& platforms, int depthMapStep, float areaScale, DepthSamples& samples, FloatArr& areas)
+{
+	std::ifstream fs(fileName, std::ios::in | std::ios::binary);
+	if (!fs.is_open())
+		return false;
+	// read header
+	HeaderDepthDataRaw header;
+	fs.read((char*)&header, sizeof(HeaderDepthDataRaw));
+	if (!fs || header.name != HeaderDepthDataRaw::HeaderDepthDataRawName() ||
+		(header.type & HeaderDepthDataRaw::HAS_DEPTH) == 0 || header.depthWidth == 0 || header.depthHeight == 0)
+		return false;
+	// skip image file name, view IDs and camera pose
+	uint16_t nFileNameSize;
+	fs.read((char*)&nFileNameSize, sizeof(uint16_t));
+	fs.seekg(nFileNameSize, std::ios::cur);
+	uint32_t nIDs;
+	fs.read((char*)&nIDs, sizeof(uint32_t));
+	fs.seekg(nIDs*sizeof(uint32_t) + (9+9+3)*sizeof(double), std::ios::cur);
+	if (!fs)
+		return false;
+	const std::streamoff depthMapBegin(fs.tellg());
+	// read only the sampled rows
+	const cv::Size size((int)header.depthWidth, (int)header.depthHeight);
+	const Camera camera(imageData.GetCamera(platforms, size));
+	CLISTDEF0(Depth) row(size.width);
+	for (int r=(size.height%depthMapStep)/2; r<size.height; r+=depthMapStep) {
+		fs.seekg(depthMapBegin + (std::streamoff)r*size.width*sizeof(Depth));
+		fs.read((char*)row.data(), size.width*sizeof(Depth));
+		if (!fs)
+			return false;
+		for (int c=(size.width%depthMapStep)/2; c<size.width; c+=depthMapStep) {
+			const Depth depth = row[c];
+			if (depth <= 0)
+				continue;
+			const Point3f& X = samples.emplace_back(Cast<float>(camera.TransformPointI2W(Point3(c,r,depth))));
+			areas.emplace_back(Footprint(camera, X)*areaScale);
+		}
+	}
+	return true;
+}
+} // unnamed namespace
+
+const double Scene::DenseCost::bytesImage(3+1);
+const double Scene::DenseCost::bytesDepthMap(sizeof(Depth)+sizeof(Normal)+sizeof(float));
+const double Scene::DenseCost::bytesPoint(sizeof(PointCloud::Point)+sizeof(PointCloud::ViewArr)+4*sizeof(PointCloud::View)+sizeof(PointCloud::Color)+sizeof(PointCloud::Normal));
+const double Scene::DenseCost::pointsPerPixel(0.25);
+
+// compute the working resolution of the given image for the current dense options
+cv::Size Scene::EstimateImageResolution(const Image& imageData)
+{
+	unsigned nResolutionLevel(OPTDENSE::nResolutionLevel);
+	const unsigned nMaxResolution(imageData.RecomputeMaxResolution(nResolutionLevel, OPTDENSE::nMinResolution, OPTDENSE::nMaxResolution));
+	const double scale(MINF((double)nMaxResolution/MAXF(imageData.width, imageData.height), 1.0));
+	return cv::Size(ROUND2INT(scale*imageData.width), ROUND2INT(scale*imageData.height));
+}
+// predict the memory needed to densify the given image at the working resolution (bytes):
+// the color and gray images, the depth, normal and confidence maps, plus the fused points
+// (see DenseCost)
+size_t Scene::EstimateImageMemory(const Image& imageData)
+{
+	const double nPixels(EstimateImageResolution(imageData).area());
+	return (size_t)(nPixels*(DenseCost::bytesImage+DenseCost::bytesDepthMap+DenseCost::bytesPoint*DenseCost::pointsPerPixel));
+}
+// predict the peak memory needed to densify the given chunk (bytes)
+size_t Scene::EstimateChunkMemory(const ImagesChunk& chunk) const
+{
+	size_t memory(0);
+	for (const IIndex idxImage: chunk.images)
+		memory += EstimateImageMemory(images[idxImage]);
+	return memory;
+}
+
 // split the scene in sub-scenes such that each sub-scene surface does not exceed the given
 // maximum sampling area; the area is composed of overlapping samples from different cameras
 // taking into account the footprint of each sample (pixels/unit-length, GSD inverse),
@@ -805,40 +977,59 @@ bool Scene::ExportCamerasMLP(const String& fileName, const String& fileNameScene
 //    can load all sub-scene's depth-maps into memory at once
 //  - limit in the same time maximum accumulated images resolution (total number of pixels)
 //    per sub-scene in order to allow all images to be loaded and processed during mesh refinement
-unsigned Scene::Split(ImagesChunkArr& chunks, float maxArea, int depthMapStep) const
+// if nMaxMemory is not 0, the chunks are refined until the predicted memory of each one fits
+// this budget (bytes), and if maxArea is 0, the initial maximum area is derived from the budget
+unsigned Scene::Split(ImagesChunkArr& chunks, float maxArea, int depthMapStep, size_t nMaxMemory) const
 {
 	TD_TIMER_STARTD();
 	// gather samples from all depth-maps
 	const float areaScale(0.01f);
-	typedef cList<Point3f::EVec,const Point3f::EVec&,0,4096,uint32_t> Samples;
+	typedef DepthSamples Samples;
 	typedef TOctree<Samples,float,3> Octree;
 	Octree octree;
-	FloatArr areas(0, images.size()*4192);
-	IIndexArr visibility(0, (IIndex)areas.capacity());
+	FloatArr areas;
+	IIndexArr visibility;
 	Unsigned32Arr imageAreas(images.size()); {
-		Samples samples(0, (uint32_t)areas.capacity());
+		// sample the depth-maps in parallel, each image into its own buffers,
+		// and concatenate them in the image order, so the result does not depend on the scheduling
+		cList<Samples> imagesSamples(images.size());
+		cList<FloatArr> imagesSampleAreas(images.size());
+		#ifdef SCENE_USE_OPENMP
+		#pragma omp parallel for schedule(dynamic)
+		for (int64_t _ID=0; _ID<images.size(); ++_ID) {
+			const IIndex idxImage(static_cast<IIndex>(_ID));
+		#else
 		FOREACH(idxImage, images) {
+		#endif
 			const Image& imageData = images[idxImage];
 			if (!imageData.IsValid())
 				continue;
-			DepthData depthData;
-			depthData.Load(ComposeDepthFilePath(imageData.ID, "dmap"));
-			if (depthData.IsEmpty())
-				continue;
-			const IIndex numPointsBegin(visibility.size());
-			const Camera camera(imageData.GetCamera(platforms, depthData.depthMap.size()));
-			for (int r=(depthData.depthMap.rows%depthMapStep)/2; r<depthData.depthMap.rows; r+=depthMapStep) {
-				for (int c=(depthData.depthMap.cols%depthMapStep)/2; c<depthData.depthMap.cols; c+=depthMapStep) {
-					const Depth depth = depthData.depthMap(r,c);
-					if (depth <= 0)
-						continue;
-					const Point3f& X = samples.emplace_back(Cast<float>(camera.TransformPointI2W(Point3(c,r,depth))));
-					areas.emplace_back(Footprint(camera, X)*areaScale);
-					visibility.emplace_back(idxImage);
-				}
+			if (!SampleDepthMapFile(ComposeDepthFilePath(imageData.ID, "dmap"), imageData, platforms, depthMapStep, areaScale,
+					imagesSamples[idxImage], imagesSampleAreas[idxImage])) {
+				imagesSamples[idxImage].Release();
+				imagesSampleAreas[idxImage].Release();
 			}
-			imageAreas[idxImage] = visibility.size()-numPointsBegin;
 		}
+		size_t numSamples(0);
+		for (const Samples& imageSamples: imagesSamples)
+			numSamples += imageSamples.size();
+		Samples samples(0, (uint32_t)numSamples);
+		areas.reserve(numSamples);
+		visibility.reserve((IIndex)numSamples);
+		FOREACH(idxImage, images) {
+			Samples& imageSamples = imagesSamples[idxImage];
+			FloatArr& imageSampleAreas = imagesSampleAreas[idxImage];
+			for (const Samples::Type& X: imageSamples)
+				samples.emplace_back(X);
+			for (float area: imageSampleAreas)
+				areas.emplace_back(area);
+			for (uint32_t i=0; i<imageSamples.size(); ++i)
+				visibility.emplace_back(idxImage);
+			imageAreas[idxImage] = imageSamples.size();
+			imageSamples.Release();
+			imageSampleAreas.Release();
+		}
+		VERBOSE("Depth-maps sampled: %u samples (%s)", samples.size(), TD_TIMER_GET_FMT().c_str());
 		#if 0
 		const AABB3f aabb(samples.data(), samples.size());
 		#else
@@ -919,86 +1110,124 @@ unsigned Scene::Split(ImagesChunkArr& chunks, float maxArea, int depthMapStep) c
 			}
 		}
 	} chunkInserter{images.size(), octree, visibility, chunks};
-	octree.SplitVolume(maxArea, areaEstimator, chunkInserter);
-	if (chunks.size() < 2)
-		return 0;
-	// remove images with very little contribution
-	const float minImageContributionRatio(0.25f);
-	FOREACH(c, chunks) {
-		ImagesChunk& chunk = chunks[c];
-		const Unsigned32Arr& chunkImageAreas = chunkInserter.imagesAreas[c];
-		for (auto it = chunk.images.begin(); it != chunk.images.end(); ) {
-			const IIndex idxImage(*it);
-			if (float(chunkImageAreas[idxImage])/float(imageAreas[idxImage]) < minImageContributionRatio)
-				it = chunk.images.erase(it);
-			else
-				++it;
-		}
+	if (maxArea <= 0) {
+		// derive the maximum area from the memory budget, using the average memory needed per unit of area
+		ASSERT(nMaxMemory > 0);
+		double totalArea(0);
+		for (float area: areas)
+			totalArea += area;
+		size_t totalMemory(0);
+		FOREACH(idxImage, images)
+			if (imageAreas[idxImage] > 0)
+				totalMemory += EstimateImageMemory(images[idxImage]);
+		maxArea = (float)(totalArea*nMaxMemory/MAXF(totalMemory, size_t(1)));
+		DEBUG_EXTRA("Maximum area %g derived from the %s memory budget", maxArea, Util::formatBytes(nMaxMemory).c_str());
 	}
-	#if 1
-	// remove images already completely contained by a larger chunk
-	const float minImageContributionRatioLargerChunk(0.9f);
-	FOREACH(cSmall, chunks) {
-		ImagesChunk& chunkSmall = chunks[cSmall];
-		const Unsigned32Arr& chunkSmallImageAreas = chunkInserter.imagesAreas[cSmall];
-		FOREACH(cLarge, chunks) {
-			const ImagesChunk& chunkLarge = chunks[cLarge];
-			if (chunkLarge.images.size() <= chunkSmall.images.size())
-				continue;
-			const Unsigned32Arr& chunkLargeImageAreas = chunkInserter.imagesAreas[cLarge];
-			for (auto it = chunkSmall.images.begin(); it != chunkSmall.images.end(); ) {
+	for (unsigned iter=0; ; ++iter) {
+		octree.SplitVolume(maxArea, areaEstimator, chunkInserter);
+		if (chunks.size() < 2)
+			return 0;
+		// remove images with very little contribution
+		const float minImageContributionRatio(0.25f);
+		FOREACH(c, chunks) {
+			ImagesChunk& chunk = chunks[c];
+			const Unsigned32Arr& chunkImageAreas = chunkInserter.imagesAreas[c];
+			for (auto it = chunk.images.begin(); it != chunk.images.end(); ) {
 				const IIndex idxImage(*it);
-				if (chunkSmallImageAreas[idxImage] < chunkLargeImageAreas[idxImage] &&
-					float(chunkLargeImageAreas[idxImage])/float(imageAreas[idxImage]) > minImageContributionRatioLargerChunk)
-					it = chunkSmall.images.erase(it);
+				if (float(chunkImageAreas[idxImage])/float(imageAreas[idxImage]) < minImageContributionRatio)
+					it = chunk.images.erase(it);
 				else
 					++it;
 			}
 		}
-	}
-	#endif
-	#if 1
-	// merge small chunks into larger chunk neighbors
-	// TODO: better manage the bounding-box merge
-	const unsigned minNumImagesPerChunk(4);
-	RFOREACH(cSmall, chunks) {
-		ImagesChunk& chunkSmall = chunks[cSmall];
-		if (chunkSmall.images.size() > minNumImagesPerChunk)
-			continue;
-		// find the chunk having the most images in common
-		IIndex idxBestChunk;
-		unsigned numLargestCommonImages(0);
-		FOREACH(cLarge, chunks) {
-			if (cSmall == cLarge)
+		#if 1
+		// remove images already completely contained by a larger chunk
+		const float minImageContributionRatioLargerChunk(0.9f);
+		FOREACH(cSmall, chunks) {
+			ImagesChunk& chunkSmall = chunks[cSmall];
+			const Unsigned32Arr& chunkSmallImageAreas = chunkInserter.imagesAreas[cSmall];
+			FOREACH(cLarge, chunks) {
+				const ImagesChunk& chunkLarge = chunks[cLarge];
+				if (chunkLarge.images.size() <= chunkSmall.images.size())
+					continue;
+				const Unsigned32Arr& chunkLargeImageAreas = chunkInserter.imagesAreas[cLarge];
+				for (auto it = chunkSmall.images.begin(); it != chunkSmall.images.end(); ) {
+					const IIndex idxImage(*it);
+					if (chunkSmallImageAreas[idxImage] < chunkLargeImageAreas[idxImage] &&
+						float(chunkLargeImageAreas[idxImage])/float(imageAreas[idxImage]) > minImageContributionRatioLargerChunk)
+						it = chunkSmall.images.erase(it);
+					else
+						++it;
+				}
+			}
+		}
+		#endif
+		#if 1
+		// merge small chunks into larger chunk neighbors
+		// TODO: better manage the bounding-box merge
+		const unsigned minNumImagesPerChunk(4);
+		RFOREACH(cSmall, chunks) {
+			ImagesChunk& chunkSmall = chunks[cSmall];
+			if (chunkSmall.images.size() > minNumImagesPerChunk)
 				continue;
-			const ImagesChunk& chunkLarge = chunks[cLarge];
-			unsigned numCommonImages(0);
-			for (const IIndex idxImage: chunkSmall.images)
-				if (chunkLarge.images.find(idxImage) != chunkLarge.images.end())
-					++numCommonImages;
-			if (numCommonImages == 0)
+			// find the chunk having the most images in common
+			IIndex idxBestChunk;
+			unsigned numLargestCommonImages(0);
+			FOREACH(cLarge, chunks) {
+				if (cSmall == cLarge)
+					continue;
+				const ImagesChunk& chunkLarge = chunks[cLarge];
+				unsigned numCommonImages(0);
+				for (const IIndex idxImage: chunkSmall.images)
+					if (chunkLarge.images.find(idxImage) != chunkLarge.images.end())
+						++numCommonImages;
+				if (numCommonImages == 0)
+					continue;
+				if (numLargestCommonImages < numCommonImages ||
+					(numLargestCommonImages == numCommonImages && chunks[idxBestChunk].images.size() < chunkLarge.images.size()))
+				{
+					numLargestCommonImages = numCommonImages;
+					idxBestChunk = cLarge;
+				}
+			}
+			if (numLargestCommonImages == 0) {
+				DEBUG_ULTIMATE("warning: small chunk can not be merged (%u chunk, %u images)",
+					cSmall, chunkSmall.images.size());
 				continue;
-			if (numLargestCommonImages < numCommonImages ||
-				(numLargestCommonImages == numCommonImages && chunks[idxBestChunk].images.size() < chunkLarge.images.size()))
-			{
-				numLargestCommonImages = numCommonImages;
-				idxBestChunk = cLarge;
 			}
+			// merge the small chunk and remove it
+			ImagesChunk& chunkLarge = chunks[idxBestChunk];
+			DEBUG_ULTIMATE("Small chunk merged: %u chunk (%u images) -> %u chunk (%u images)",
+				cSmall, chunkSmall.images.size(), idxBestChunk, chunkLarge.images.size());
+			chunkLarge.aabb.Insert(chunkSmall.aabb);
+			chunkLarge.images.insert(chunkSmall.images.begin(), chunkSmall.images.end());
+			chunks.RemoveAt(cSmall);
 		}
-		if (numLargestCommonImages == 0) {
-			DEBUG_ULTIMATE("warning: small chunk can not be merged (%u chunk, %u images)",
-				cSmall, chunkSmall.images.size());
-			continue;
+		#endif
+		if (nMaxMemory == 0)
+			break;
+		// the images of a chunk are loaded entirely, even if they only partially see it,
+		// so split finer while the predicted memory of a chunk exceeds the budget
+		size_t maxChunkMemory(0);
+		IIndex idxMaxChunk(NO_ID);
+		FOREACH(c, chunks) {
+			const size_t chunkMemory(EstimateChunkMemory(chunks[c]));
+			if (maxChunkMemory < chunkMemory) {
+				maxChunkMemory = chunkMemory;
+				idxMaxChunk = c;
+			}
+		}
+		if (maxChunkMemory <= nMaxMemory)
+			break;
+		if (iter >= 8) {
+			VERBOSE("warning: chunk %u (%u images) is still predicted to need %s, exceeding the memory budget of %s",
+				idxMaxChunk, chunks[idxMaxChunk].images.size(), Util::formatBytes(maxChunkMemory).c_str(), Util::formatBytes(nMaxMemory).c_str());
+			break;
 		}
-		// merge the small chunk and remove it
-		ImagesChunk& chunkLarge = chunks[idxBestChunk];
-		DEBUG_ULTIMATE("Small chunk merged: %u chunk (%u images) -> %u chunk (%u images)",
-			cSmall, chunkSmall.images.size(), idxBestChunk, chunkLarge.images.size());
-		chunkLarge.aabb.Insert(chunkSmall.aabb);
-		chunkLarge.images.insert(chunkSmall.images.begin(), chunkSmall.images.end());
-		chunks.RemoveAt(cSmall);
+		maxArea *= 0.9f*(float)((double)nMaxMemory/maxChunkMemory);
+		chunks.Release();
+		chunkInserter.imagesAreas.Release();
 	}
-	#endif
 	DEBUG_EXTRA("Scene split (%g max-area): %u chunks (%s)", maxArea, chunks.size(), TD_TIMER_GET_FMT().c_str());
 	#if 0 || defined(_DEBUG)
 	// dump chunks for visualization
@@ -1012,92 +1241,244 @@ unsigned Scene::Split(ImagesChunkArr& chunks, float maxArea, int depthMapStep) c
 	return chunks.size();
 } // Split
 
-// split the scene in sub-scenes according to the given chunks array, and save them to disk
-bool Scene::ExportChunks(const ImagesChunkArr& chunks, const String& path, ARCHIVE_TYPE type) const
+// compute for each image of this scene its index in the sub-scene of the given chunk (NO_ID if not part of it)
+void Scene::MapChunkImages(const ImagesChunk& chunk, IIndexArr& mapImages) const
 {
-	FOREACH(chunkID, chunks) {
-		const ImagesChunk& chunk = chunks[chunkID];
-		Scene subset;
-		subset.nCalibratedImages = (IIndex)chunk.images.size();
-		// extract chunk images
-		typedef std::unordered_map<IIndex,IIndex> MapIIndex;
-		MapIIndex mapPlatforms(platforms.size());
-		MapIIndex mapImages(images.size());
-		FOREACH(idxImage, images) {
-			if (chunk.images.find(idxImage) == chunk.images.end())
-				continue;
-			const Image& image = images[idxImage];
-			if (!image.IsValid())
+	mapImages.resize(images.size());
+	std::fill(mapImages.begin(), mapImages.end(), NO_ID);
+	IIndex idxImageChunk(0);
+	FOREACH(idxImage, images)
+		if (chunk.images.find(idxImage) != chunk.images.end() && images[idxImage].IsValid())
+			mapImages[idxImage] = idxImageChunk++;
+} // MapChunkImages
+
+// extract the images of the given chunk into the sub-scene, together with their platforms and poses;
+// the neighbor views are remapped to the sub-scene images, and the image IDs are set to the image
+// indices in this scene; mapImages receives for each image of this scene its index in the sub-scene (NO_ID if not part of it)
+void Scene::ExtractChunkImages(const ImagesChunk& chunk, Scene& subset, IIndexArr& mapImages) const
+{
+	subset.nCalibratedImages = (IIndex)chunk.images.size();
+	typedef std::unordered_map<IIndex,IIndex> MapIIndex;
+	MapIIndex mapPlatforms(platforms.size());
+	MapChunkImages(chunk, mapImages);
+	FOREACH(idxImage, images) {
+		if (mapImages[idxImage] == NO_ID)
+			continue;
+		const Image& image = images[idxImage];
+		// copy platform
+		const Platform& platform = platforms[image.platformID];
+		MapIIndex::iterator itSubPlatformMVS = mapPlatforms.find(image.platformID);
+		uint32_t subPlatformID;
+		if (itSubPlatformMVS == mapPlatforms.end()) {
+			ASSERT(subset.platforms.size() == mapPlatforms.size());
+			subPlatformID = subset.platforms.size();
+			mapPlatforms.emplace(image.platformID, subPlatformID);
+			Platform subPlatform;
+			subPlatform.name = platform.name;
+			subPlatform.cameras = platform.cameras;
+			subset.platforms.emplace_back(std::move(subPlatform));
+		} else {
+			subPlatformID = itSubPlatformMVS->second;
+		}
+		Platform& subPlatform = subset.platforms[subPlatformID];
+		// copy image
+		ASSERT(mapImages[idxImage] == subset.images.size());
+		Image subImage(image);
+		subImage.platformID = subPlatformID;
+		subImage.poseID = subPlatform.poses.size();
+		subImage.ID = idxImage;
+		subset.images.emplace_back(std::move(subImage));
+		// copy pose
+		subPlatform.poses.emplace_back(platform.poses[image.poseID]);
+	}
+	// map image IDs from global to local
+	for (Image& image: subset.images) {
+		RFOREACH(i, image.neighbors) {
+			ViewScore& neighbor = image.neighbors[i];
+			const IIndex idxImageNew(mapImages[neighbor.idx.ID]);
+			if (idxImageNew == NO_ID) {
+				image.neighbors.RemoveAtMove(i);
 				continue;
-			// copy platform
-			const Platform& platform = platforms[image.platformID];
-			MapIIndex::iterator itSubPlatformMVS = mapPlatforms.find(image.platformID);
-			uint32_t subPlatformID;
-			if (itSubPlatformMVS == mapPlatforms.end()) {
-				ASSERT(subset.platforms.size() == mapPlatforms.size());
-				subPlatformID = subset.platforms.size();
-				mapPlatforms.emplace(image.platformID, subPlatformID);
-				Platform subPlatform;
-				subPlatform.name = platform.name;
-				subPlatform.cameras = platform.cameras;
-				subset.platforms.emplace_back(std::move(subPlatform));
-			} else {
-				subPlatformID = itSubPlatformMVS->second;
 			}
-			Platform& subPlatform = subset.platforms[subPlatformID];
-			// copy image
-			const IIndex idxImageNew((IIndex)mapImages.size());
-			mapImages[idxImage] = idxImageNew;
-			Image subImage(image);
-			subImage.platformID = subPlatformID;
-			subImage.poseID = subPlatform.poses.size();
-			subImage.ID = idxImage;
-			subset.images.emplace_back(std::move(subImage));
-			// copy pose
-			subPlatform.poses.emplace_back(platform.poses[image.poseID]);
+			ASSERT(idxImageNew < subset.images.size());
+			neighbor.idx.ID = idxImageNew;
 		}
-		// map image IDs from global to local
-		for (Image& image: subset.images) {
-			RFOREACH(i, image.neighbors) {
-				ViewScore& neighbor = image.neighbors[i];
-				const auto itImage(mapImages.find(neighbor.idx.ID));
-				if (itImage == mapImages.end()) {
-					image.neighbors.RemoveAtMove(i);
-					continue;
-				}
-				ASSERT(itImage->second < subset.images.size());
-				neighbor.idx.ID = itImage->second;
-			}
+	}
+	// set scene ROI
+	subset.obb.Set(OBB3f::MATRIX::Identity(), chunk.aabb.ptMin, chunk.aabb.ptMax);
+} // ExtractChunkImages
+
+// find the points of all sub-scenes (as returned by ExtractChunkImages()) in a single pass over the point-cloud:
+// each point is listed in every sub-scene containing at least two of the images seeing it
+void Scene::IndexChunksPoints(const CLISTDEF2(IIndexArr)& chunksMapImages, CLISTDEF2(PointCloud::IndexArr)& chunksPoints) const
+{
+	const IIndex nChunks(chunksMapImages.size());
+	chunksPoints.Release();
+	chunksPoints.resize(nChunks);
+	// index the sub-scenes each image is part of
+	CLISTDEF2(IIndexArr) imageChunks(images.size());
+	for (IIndex c=0; c<nChunks; ++c) {
+		const IIndexArr& mapImages = chunksMapImages[c];
+		FOREACH(idxImage, images)
+			if (mapImages[idxImage] != NO_ID)
+				imageChunks[idxImage].emplace_back(c);
+	}
+	// count for each point the views in each sub-scene, and list it where seen at least twice
+	Unsigned32Arr chunkViews(nChunks);
+	chunkViews.Memset(0);
+	IIndexArr touchedChunks(0, nChunks);
+	FOREACH(idxPoint, pointcloud.points) {
+		for (const PointCloud::View idxImage: pointcloud.pointViews[idxPoint])
+			for (const IIndex c: imageChunks[idxImage])
+				if (chunkViews[c]++ == 0)
+					touchedChunks.emplace_back(c);
+		for (const IIndex c: touchedChunks) {
+			if (chunkViews[c] >= 2)
+				chunksPoints[c].emplace_back(idxPoint);
+			chunkViews[c] = 0;
 		}
-		// extract point-cloud
-		FOREACH(idxPoint, pointcloud.points) {
-			PointCloud::ViewArr subViews;
-			PointCloud::WeightArr subWeights;
-			const PointCloud::ViewArr& views = pointcloud.pointViews[idxPoint];
-			FOREACH(i, views) {
-				const IIndex idxImage(views[i]);
-				const auto itImage(mapImages.find(idxImage));
-				if (itImage == mapImages.end())
-					continue;
-				subViews.emplace_back(itImage->second);
-				if (!pointcloud.pointWeights.empty())
-					subWeights.emplace_back(pointcloud.pointWeights[idxPoint][i]);
-			}
-			if (subViews.size() < 2)
+		touchedChunks.Empty();
+	}
+} // IndexChunksPoints
+
+// extract the given points (as returned by IndexChunksPoints()) into the sub-scene,
+// keeping only the views of the images part of it (as returned by ExtractChunkImages())
+void Scene::ExtractChunkPoints(const IIndexArr& mapImages, const PointCloud::IndexArr& points, Scene& subset) const
+{
+	PointCloud& subPointCloud = subset.pointcloud;
+	subPointCloud.points.reserve(points.size());
+	subPointCloud.pointViews.reserve(points.size());
+	if (!pointcloud.pointWeights.empty())
+		subPointCloud.pointWeights.reserve(points.size());
+	if (!pointcloud.colors.empty())
+		subPointCloud.colors.reserve(points.size());
+	for (const PointCloud::Index idxPoint: points) {
+		const PointCloud::ViewArr& views = pointcloud.pointViews[idxPoint];
+		PointCloud::ViewArr& subViews = subPointCloud.pointViews.AddEmpty();
+		PointCloud::WeightArr* pSubWeights(pointcloud.pointWeights.empty() ? NULL : &subPointCloud.pointWeights.AddEmpty());
+		FOREACH(i, views) {
+			const IIndex idxImageNew(mapImages[views[i]]);
+			if (idxImageNew == NO_ID)
 				continue;
-			subset.pointcloud.points.emplace_back(pointcloud.points[idxPoint]);
-			subset.pointcloud.pointViews.emplace_back(std::move(subViews));
-			if (!pointcloud.pointWeights.empty())
-				subset.pointcloud.pointWeights.emplace_back(std::move(subWeights));
-			if (!pointcloud.colors.empty())
-				subset.pointcloud.colors.emplace_back(pointcloud.colors[idxPoint]);
+			subViews.emplace_back(idxImageNew);
+			if (pSubWeights)
+				pSubWeights->emplace_back(pointcloud.pointWeights[idxPoint][i]);
 		}
-		// set scene ROI
-		subset.obb.Set(OBB3f::MATRIX::Identity(), chunk.aabb.ptMin, chunk.aabb.ptMax);
-		// serialize out the current state
+		subPointCloud.points.emplace_back(pointcloud.points[idxPoint]);
+		if (!pointcloud.colors.empty())
+			subPointCloud.colors.emplace_back(pointcloud.colors[idxPoint]);
+	}
+} // ExtractChunkPoints
+
+// split the scene in sub-scenes according to the given chunks array, and save them to disk;
+// the points of all sub-scenes are indexed in a single pass, and next each sub-scene
+// is extracted and saved in parallel, so only the sub-scenes being saved are kept in memory
+bool Scene::ExportChunks(const ImagesChunkArr& chunks, const String& path, ARCHIVE_TYPE type) const
+{
+	TD_TIMER_STARTD();
+	// find the images and the points of each sub-scene
+	CLISTDEF2(IIndexArr) chunksMapImages(chunks.size());
+	FOREACH(chunkID, chunks)
+		MapChunkImages(chunks[chunkID], chunksMapImages[chunkID]);
+	CLISTDEF2(PointCloud::IndexArr) chunksPoints;
+	IndexChunksPoints(chunksMapImages, chunksPoints);
+	// extract and serialize out the sub-scenes in parallel
+	volatile bool bAbort(false);
+	#ifdef SCENE_USE_OPENMP
+	#pragma omp parallel for schedule(dynamic)
+	for (int64_t _chunkID=0; _chunkID<(int64_t)chunks.size(); ++_chunkID) {
+		const IIndex chunkID(static_cast<IIndex>(_chunkID));
+	#else
+	FOREACH(chunkID, chunks) {
+	#endif
+		if (bAbort)
+			continue;
+		Scene subset;
+		ExtractChunkImages(chunks[chunkID], subset, chunksMapImages[chunkID]);
+		ExtractChunkPoints(chunksMapImages[chunkID], chunksPoints[chunkID], subset);
+		chunksPoints[chunkID].Release();
 		if (!subset.Save(String::FormatString("%s" PATH_SEPARATOR_STR "scene_%04u.mvs", path.c_str(), chunkID), type))
-			return false;
+			bAbort = true;
 	}
-	return true;
+	DEBUG_EXTRA("Scene chunks exported: %u chunks (%s)", chunks.size(), TD_TIMER_GET_FMT().c_str());
+	return !bAbort;
 } // ExportChunks
+
+// append the given sub-scene point-cloud to the scene point-cloud, mapping its views
+// through mapViews (sub-scene image index to scene image index); the views are moved,
+// and the optional attributes are kept only if all appended point-clouds have them
+void Scene::AppendChunkPoints(PointCloud& pc, const IIndexArr& mapViews)
+{
+	const bool bColors(!pc.colors.IsEmpty() && pointcloud.colors.size() == pointcloud.points.size());
+	const bool bNormals(!pc.normals.IsEmpty() && pointcloud.normals.size() == pointcloud.points.size());
+	const bool bWeights(!pc.pointWeights.IsEmpty() && pointcloud.pointWeights.size() == pointcloud.points.size());
+	if (!bColors) pointcloud.colors.Release();
+	if (!bNormals) pointcloud.normals.Release();
+	if (!bWeights) pointcloud.pointWeights.Release();
+	FOREACH(i, pc.points) {
+		pointcloud.points.emplace_back(pc.points[i]);
+		PointCloud::ViewArr& views = pointcloud.pointViews.emplace_back(std::move(pc.pointViews[i]));
+		for (PointCloud::View& idxView: views)
+			idxView = mapViews[idxView];
+		if (bColors)
+			pointcloud.colors.emplace_back(pc.colors[i]);
+		if (bNormals)
+			pointcloud.normals.emplace_back(pc.normals[i]);
+		if (bWeights)
+			pointcloud.pointWeights.emplace_back(std::move(pc.pointWeights[i]));
+	}
+} // AppendChunkPoints
+
+// merge the dense point-clouds of the given sub-scenes (as exported by ExportChunks() and densified
+// independently) into the scene point-cloud, loading only one sub-scene at a time:
+// only the points inside the region-of-interest of their sub-scene are kept, and if fVoxelSize > 0,
+// a point falling in a voxel already occupied by a point of a previous sub-scene is dropped as duplicate
+bool Scene::MergeChunks(const StringArr& fileNames, float fVoxelSize)
+{
+	TD_TIMER_STARTD();
+	pointcloud.Release();
+	InvalidateImagePoints();
+	const float invVoxelSize(fVoxelSize > 0 ? 1.f/fVoxelSize : 0.f);
+	std::unordered_set<GridCell,GridCellHash> voxels;
+	for (const String& fileName: fileNames) {
+		Scene chunk(nMaxThreads);
+		if (!chunk.Load(fileName)) {
+			VERBOSE("error: can not load sub-scene '%s'", fileName.c_str());
+			return false;
+		}
+		// map the sub-scene images to the scene images (the sub-scene image IDs are the scene image indices)
+		IIndexArr mapViews(chunk.images.size());
+		FOREACH(i, chunk.images) {
+			mapViews[i] = chunk.images[i].ID;
+			if (mapViews[i] >= images.size()) {
+				VERBOSE("error: sub-scene '%s' does not belong to this scene", fileName.c_str());
+				return false;
+			}
+		}
+		PointCloud& pc = chunk.pointcloud;
+		const PointCloud::Index nPoints((PointCloud::Index)pc.GetSize());
+		// keep only the points inside the sub-scene region
+		if (chunk.obb.IsValid())
+			pc.RemovePointsOutside(chunk.obb);
+		const PointCloud::Index nPointsROI((PointCloud::Index)pc.GetSize());
+		if (fVoxelSize > 0) {
+			// remove the points already covered by the previous sub-scenes
+			std::vector<GridCell> keys;
+			keys.reserve(pc.GetSize());
+			RFOREACH(i, pc.points) {
+				const GridCell key(GetGridCell(pc.points[i], invVoxelSize));
+				if (voxels.find(key) != voxels.end())
+					pc.RemovePoint(i);
+				else
+					keys.emplace_back(key);
+			}
+			voxels.insert(keys.begin(), keys.end());
+		}
+		AppendChunkPoints(pc, mapViews);
+		DEBUG_EXTRA("Sub-scene '%s' merged: %u points (%u outside the region, %u duplicates)",
+			Util::getFileNameExt(fileName).c_str(), pc.GetSize(), nPoints-nPointsROI, nPointsROI-(PointCloud::Index)pc.GetSize());
+	}
+	DEBUG_EXTRA("Sub-scenes merged: %u sub-scenes, %u points (%s)", fileNames.size(), pointcloud.GetSize(), TD_TIMER_GET_FMT().c_str());
+	return !pointcloud.IsEmpty();
+} // MergeChunks
 /*----------------------------------------------------------------*/
@@ -60,6 +60,12 @@ public:
 
 	unsigned nCalibratedImages; // number of valid images
 
+	// inverted index of the point-cloud observations (CSR format): the points seen by image i
+	// are imagePoints[imagePointsOffsets[i]] ... imagePoints[imagePointsOffsets[i+1]-1], sorted by index;
+	// built on demand before the parallel view selection, and invalidated whenever the point-cloud is replaced
+	UnsignedArr imagePointsOffsets;
+	PointCloud::IndexArr imagePoints;
+
 	unsigned nMaxThreads; // maximum number of threads used to distribute the work load
 
 public:
@@ -70,6 +76,10 @@ public:
 	bool IsEmpty() const;
 	bool ImagesHaveNeighbors() const;
 
+	void IndexImagePoints();
+	void InvalidateImagePoints();
+	bool IsImagePointsIndexed() const;
+
 	bool LoadInterface(const String& fileName);
 	bool SaveInterface(const String& fileName, int version=-1) const;
 
@@ -82,6 +92,7 @@ public:
 	void SampleMeshWithVisibility(unsigned maxResolution=320);
 
 	bool SelectNeighborViews(uint32_t ID, IndexArr& points, unsigned nMinViews=3, unsigned nMinPointViews=2, float fOptimAngle=FD2R(10));
+	unsigned SelectNeighborViews(unsigned nMinViews, unsigned nMinPointViews, float fOptimAngle);
 	static bool FilterNeighborViews(ViewScoreArr& neighbors, float fMinArea=0.1f, float fMinScale=0.2f, float fMaxScale=2.4f, float fMinAngle=FD2R(3), float fMaxAngle=FD2R(45), unsigned nMaxViews=12);
 
 	bool ExportCamerasMLP(const String& fileName, const String& fileNameScene) const;
@@ -92,19 +103,46 @@ public:
 		AABB3f aabb;
 	};
 	typedef cList<ImagesChunk,const ImagesChunk&,2,16,uint32_t> ImagesChunkArr;
-	unsigned Split(ImagesChunkArr& chunks, float maxArea, int depthMapStep=8) const;
+	unsigned Split(ImagesChunkArr& chunks, float maxArea, int depthMapStep=8, size_t nMaxMemory=0) const;
+	// fixed cost model of the dense reconstruction, shared by the memory and disk predictions
+	// (the constants are estimates, not calibrated against measured runs)
+	struct DenseCost {
+		static const double bytesImage; // per pixel: color and gray images
+		static const double bytesDepthMap; // per pixel: depth, normal and confidence maps
+		static const double bytesPoint; // per fused point: position, views, color and normal
+		static const double pointsPerPixel; // fused points per pixel
+	};
+	static cv::Size EstimateImageResolution(const Image& imageData);
+	static size_t EstimateImageMemory(const Image& imageData);
+	size_t EstimateChunkMemory(const ImagesChunk& chunk) const;
+	void MapChunkImages(const ImagesChunk& chunk, IIndexArr& mapImages) const;
+	void ExtractChunkImages(const ImagesChunk& chunk, Scene& subset, IIndexArr& mapImages) const;
+	void IndexChunksPoints(const CLISTDEF2(IIndexArr)& chunksMapImages, CLISTDEF2(PointCloud::IndexArr)& chunksPoints) const;
+	void ExtractChunkPoints(const IIndexArr& mapImages, const PointCloud::IndexArr& points, Scene& subset) const;
 	bool ExportChunks(const ImagesChunkArr& chunks, const String& path, ARCHIVE_TYPE type=ARCHIVE_DEFAULT) const;
+	void AppendChunkPoints(PointCloud& pc, const IIndexArr& mapViews);
+	bool MergeChunks(const StringArr& fileNames, float fVoxelSize=0);
 
 	// Dense reconstruction
+	bool DenseReconstruction(int nFusionMode=0, bool bReuseDepthMaps=false);
+	bool DenseReconstructionChunks(const ImagesChunkArr& chunks, size_t nMaxMemory=0);
+	int DenseReconstructionWorker(bool bFuse, float fLockTimeout=0);
+	void PlanDenseReconstruction() const;
+	bool ComputeDepthMaps(DenseDepthMapData& data);
+	bool DenseFuseNewImages(const IIndexArr& newImages);
 	void DenseReconstructionEstimate(void*);
 	void DenseReconstructionFilter(void*);
 	void PointCloudFilter(int thRemove=-1);
+	void PointCloudEstimateNormals(unsigned nNeighbors=16);
+	void PointCloudRemoveOutliers(unsigned nNeighbors=16, float fStdDevMul=2.f, float fRadius=0, unsigned nMinNeighbors=4);
 
 	// Mesh reconstruction
 	bool ReconstructMesh(float distInsert=2, bool bUseFreeSpaceSupport=true, unsigned nItersFixNonManifold=4,
 						 float kSigma=2.f, float kQual=1.f, float kb=4.f,
 						 float kf=3.f, float kRel=0.1f/*max 0.3*/, float kAbs=1000.f/*min 500*/, float kOutl=400.f/*max 700.f*/,
-						 float kInf=(float)(INT_MAX/8));
+						 float kInf=(float)(INT_MAX/8),
+						 unsigned nMaxChunkPoints=0, float fChunkOverlap=0.1f);
+	bool ReconstructMeshChunks(unsigned nMaxChunkPoints, float fChunkOverlap, const std::function<bool(Scene&)>& reconstructChunk, unsigned nItersFixNonManifold=4);
 
 	// Mesh refinement
 	bool RefineMesh(unsigned nResolutionLevel, unsigned nMinResolution, unsigned nMaxViews, float fDecimateMesh, unsigned nCloseHoles, unsigned nEnsureEdgeSize, unsigned nMaxFaceArea, unsigned nScales, float fScaleStep, unsigned nReduceMemory, unsigned nAlternatePair, float fRegularityWeight, float fRatioRigidityElasticity, float fThPlanarVertex, float fGradientStep);
@@ -33,6 +33,16 @@
 #include "Scene.h"
 #include "SceneDensify.h"
 #include "PatchMatchCUDA.h"
+#include <bitset>
+#include <fcntl.h>
+#include <sys/stat.h>
+#ifdef _MSC_VER
+#include <io.h>
+#include <sys/utime.h>
+#else
+#include <unistd.h>
+#include <utime.h>
+#endif
 
 using namespace MVS;
 
@@ -114,6 +124,20 @@ public:
 /*----------------------------------------------------------------*/
 
 
+namespace MVS {
+namespace OPTDENSE {
+String strFusionStatsFileName;
+float fFusionSpacing(0);
+unsigned nFusionMaxPoints(0);
+float fViewMinGain(0);
+float fViewTimeBudget(0);
+unsigned nImageRangeBegin(0);
+unsigned nImageRangeEnd(0);
+} // namespace OPTDENSE
+} // namespace MVS
+/*----------------------------------------------------------------*/
+
+
 // convert the ZNCC score to a weight used to average the fused points
 inline float Conf2Weight(float conf, Depth depth) {
 	return 1.f/(MAXF(1.f-conf,0.03f)*depth*depth);
@@ -127,8 +151,16 @@ inline float Conf2Weight(float conf, Depth depth) {
 DepthMapsData::DepthMapsData(Scene& _scene)
 	:
 	scene(_scene),
-	arrDepthData(_scene.images.GetSize())
+	arrDepthData(_scene.images.GetSize()),
+	nFilterJobs(0),
+	nEstimationJobs(0),
+	fViewCost(0),
+	nViewCostSamples(0),
+	arrPredictedTime(_scene.images.GetSize()),
+	arrNumViews(_scene.images.GetSize())
 {
+	arrPredictedTime.Memset(0);
+	arrNumViews.Memset(0);
 } // constructor
 
 DepthMapsData::~DepthMapsData()
@@ -139,15 +171,25 @@ DepthMapsData::~DepthMapsData()
 
 // compute visibility for the reference image (the first image in "images")
 // and select the best views for reconstructing the depth-map;
-// extract also all 3D points seen by the reference image
+// extract also all 3D points seen by the reference image;
+// if the neighbor views are already known (ex. loaded with the scene), only filter them
 bool DepthMapsData::SelectViews(DepthData& depthData)
 {
 	// find and sort valid neighbor views
 	const IIndex idxImage((IIndex)(&depthData-arrDepthData.Begin()));
-	ASSERT(depthData.neighbors.IsEmpty());
-	ASSERT(scene.images[idxImage].neighbors.IsEmpty());
-	if (!scene.SelectNeighborViews(idxImage, depthData.points, OPTDENSE::nMinViews, OPTDENSE::nMinViewsTrustPoint>1?OPTDENSE::nMinViewsTrustPoint:2, FD2R(OPTDENSE::fOptimAngle)))
-		return false;
+	ASSERT(depthData.neighbors.IsEmpty() && depthData.points.IsEmpty());
+	const unsigned nMinPointViews(OPTDENSE::nMinViewsTrustPoint>1?OPTDENSE::nMinViewsTrustPoint:2);
+	if (scene.images[idxImage].neighbors.IsEmpty()) {
+		if (!scene.SelectNeighborViews(idxImage, depthData.points, OPTDENSE::nMinViews, nMinPointViews, FD2R(OPTDENSE::fOptimAngle)))
+			return false;
+	} else {
+		// extract only the 3D points seen by the reference image
+		ASSERT(scene.IsImagePointsIndexed());
+		const PointCloud::Index* const pPointsEnd(scene.imagePoints.Begin()+scene.imagePointsOffsets[idxImage+1]);
+		for (const PointCloud::Index* pIdx=scene.imagePoints.Begin()+scene.imagePointsOffsets[idxImage]; pIdx!=pPointsEnd; ++pIdx)
+			if (scene.pointcloud.pointViews[*pIdx].GetSize() >= nMinPointViews)
+				depthData.points.Insert(*pIdx);
+	}
 	depthData.neighbors.CopyOf(scene.images[idxImage].neighbors);
 
 	// remove invalid neighbor views
@@ -202,6 +244,19 @@ bool DepthMapsData::InitViews(DepthData& depthData, IIndex idxNeighbor, IIndex n
 	} else {
 		// initialize all neighbor views too (global reconstruction is used)
 		const float fMinScore(MAXF(depthData.neighbors.First().score*(OPTDENSE::fViewMinScoreRatio*0.1f), OPTDENSE::fViewMinScore));
+		if (loadDepthMaps == 0 && (OPTDENSE::fViewMinGain > 0 || OPTDENSE::fViewTimeBudget > 0)) {
+			// adapt the number of views to their marginal gain and to the time budget
+			IIndex numViews(0);
+			while (numViews < depthData.neighbors.GetSize() && (!numNeighbors || numViews < numNeighbors) &&
+				depthData.neighbors[numViews].score >= fMinScore)
+				++numViews;
+			arrNumViews[idxImage] = MAXF(AdaptiveNumViews(depthData, numViews, arrPredictedTime[idxImage]), (IIndex)1);
+			DEBUG_EXTRA("Reference image %3u adaptively uses %u/%u views (predicted time %.2fs)", idxImage, arrNumViews[idxImage], numViews, arrPredictedTime[idxImage]);
+		}
+		if (arrNumViews[idxImage] > 0) {
+			// use the same views as selected for the initial estimation (ex. during the geometric iterations)
+			numNeighbors = arrNumViews[idxImage];
+		}
 		FOREACH(idx, depthData.neighbors) {
 			const ViewScore& neighbor = depthData.neighbors[idx];
 			if ((numNeighbors && depthData.images.GetSize() > numNeighbors) ||
@@ -312,6 +367,92 @@ bool DepthMapsData::InitViews(DepthData& depthData, IIndex idxNeighbor, IIndex n
 	}
 	return true;
 } // InitViews
+
+// select how many of the first numViews neighbor views are worth using for estimating the depth-map:
+// the views are taken in order and the selection stops at the first view that neither increases
+// the area of the reference image covered by the sparse points shared with the selected views,
+// nor the spread of their baselines, by at least OPTDENSE::fViewMinGain,
+// or at the first view whose addition is predicted to exceed OPTDENSE::fViewTimeBudget
+IIndex DepthMapsData::AdaptiveNumViews(const DepthData& depthData, IIndex numViews, float& predictedTime)
+{
+	const IIndex idxImage((IIndex)(&depthData-arrDepthData.Begin()));
+	const Image& imageData = scene.images[idxImage];
+	ASSERT(numViews <= depthData.neighbors.GetSize());
+	// mark the cells of a coarse grid over the reference image covered by the points shared with each view
+	enum { COVERAGE_GRID = 16 };
+	typedef std::bitset<COVERAGE_GRID*COVERAGE_GRID> CoverageMask;
+	const Point2f bounds(imageData.GetSize());
+	const Point2f cellScale(float(COVERAGE_GRID)/bounds.x, float(COVERAGE_GRID)/bounds.y);
+	CoverageMask maskRef;
+	cList<CoverageMask> masks(numViews);
+	for (const IndexArr::Type idx: depthData.points) {
+		const Point2f pt(imageData.camera.ProjectPointP(scene.pointcloud.points[idx]));
+		if (!imageData.camera.IsInside(pt, bounds))
+			continue;
+		const int cellX(MINF(MAXF(FLOOR2INT(pt.x*cellScale.x), 0), (int)COVERAGE_GRID-1));
+		const int cellY(MINF(MAXF(FLOOR2INT(pt.y*cellScale.y), 0), (int)COVERAGE_GRID-1));
+		const size_t cell((size_t)(cellY*COVERAGE_GRID+cellX));
+		maskRef.set(cell);
+		for (const PointCloud::View idxView: scene.pointcloud.pointViews[idx]) {
+			for (IIndex n=0; n<numViews; ++n) {
+				if (depthData.neighbors[n].idx.ID == idxView) {
+					masks[n].set(cell);
+					break;
+				}
+			}
+		}
+	}
+	// read the current calibration of the estimation time
+	double fCost;
+	{
+		Lock l(csViewCost);
+		fCost = fViewCost;
+	}
+	const double nPixels((double)imageData.width*imageData.height);
+	// add views while they bring enough new information
+	const float fMinCosAngle(COS(FD2R(OPTDENSE::fOptimAngle)));
+	const float nCellsRef((float)MAXF(maskRef.count(), size_t(1)));
+	CoverageMask maskCovered;
+	cList<Point3> directions(0, numViews);
+	IIndex n(0);
+	for (; n<numViews; ++n) {
+		const Image& imageDataB = scene.images[depthData.neighbors[n].idx.ID];
+		const Point3 dir(normalized(Point3(imageDataB.camera.C-imageData.camera.C)));
+		if (n > 0) {
+			if (OPTDENSE::fViewMinGain > 0) {
+				// marginal coverage gain, relative to the area covered by all the shared points
+				const float coverageGain(float((masks[n] & ~maskCovered).count())/nCellsRef);
+				// marginal baseline gain, as the angle to the closest selected baseline relative to the optimal angle
+				double maxCos(-1);
+				for (const Point3& dirPrev: directions)
+					maxCos = MAXF(maxCos, dir.dot(dirPrev));
+				const float baselineGain(MINF((1.f-(float)maxCos)/MAXF(1.f-fMinCosAngle, FLT_EPSILON), 1.f));
+				if (MAXF(coverageGain, baselineGain) < OPTDENSE::fViewMinGain)
+					break;
+			}
+			if (OPTDENSE::fViewTimeBudget > 0 && fCost > 0 && fCost*nPixels*(n+1) > OPTDENSE::fViewTimeBudget)
+				break;
+		}
+		maskCovered |= masks[n];
+		directions.Insert(dir);
+	}
+	predictedTime = (float)(fCost*nPixels*n);
+	return n;
+} // AdaptiveNumViews
+
+// update the estimation time calibration with the measured time of the given depth-map
+void DepthMapsData::UpdateViewCost(IIndex idxImage, float time)
+{
+	const DepthData& depthData = arrDepthData[idxImage];
+	if (depthData.images.GetSize() < 2)
+		return;
+	const Image& imageData = scene.images[idxImage];
+	const double nPixelViews((double)imageData.width*imageData.height*(depthData.images.GetSize()-1));
+	Lock l(csViewCost);
+	fViewCost = (fViewCost*nViewCostSamples + time/nPixelViews)/(nViewCostSamples+1);
+	++nViewCostSamples;
+	DEBUG_EXTRA("Depth-map for image %3u estimated with %u views in %.2fs (predicted %.2fs)", idxImage, depthData.images.GetSize()-1, time, arrPredictedTime[idxImage]);
+} // UpdateViewCost
 /*----------------------------------------------------------------*/
 
 // roughly estimate depth and normal maps by triangulating the sparse point cloud
@@ -597,241 +738,310 @@ bool DepthMapsData::EstimateDepthMap(IIndex idxImage, int nGeometricIter)
 /*----------------------------------------------------------------*/
 
 
-// filter out small depth segments from the given depth map
+// process the given number of rows in blocks of rows, distributed over the given number of threads;
+// the function is called for each block with the first and last+1 row and the index of the thread processing it
+typedef std::function<void(int,int,unsigned)> RowBlockFunction;
+namespace {
+struct RowBlocksData {
+	const RowBlockFunction* pFunction;
+	volatile Thread::safe_t* pIdxBlock;
+	int nRows;
+	int nRowsBlock;
+	unsigned idxThread;
+};
+void* STCALL ProcessRowBlocksTmp(void* arg)
+{
+	const RowBlocksData& data = *((const RowBlocksData*)arg);
+	int rowBegin;
+	while ((rowBegin=(int)Thread::safeInc(*data.pIdxBlock)*data.nRowsBlock) < data.nRows)
+		(*data.pFunction)(rowBegin, MINF(rowBegin+data.nRowsBlock, data.nRows), data.idxThread);
+	return NULL;
+}
+} // unnamed namespace
+static void ProcessRowBlocks(int nRows, int nRowsBlock, unsigned nThreads, const RowBlockFunction& function)
+{
+	ASSERT(nThreads > 0 && nRowsBlock > 0);
+	nThreads = MINF(nThreads, (unsigned)((nRows+nRowsBlock-1)/nRowsBlock));
+	if (nThreads <= 1) {
+		function(0, nRows, 0);
+		return;
+	}
+	volatile Thread::safe_t idxBlock(-1);
+	cList<RowBlocksData> datas(nThreads);
+	FOREACH(t, datas) {
+		RowBlocksData& data = datas[t];
+		data.pFunction = &function;
+		data.pIdxBlock = &idxBlock;
+		data.nRows = nRows;
+		data.nRowsBlock = nRowsBlock;
+		data.idxThread = t;
+	}
+	cList<SEACAVE::Thread> threads(nThreads-1); // current thread is also used
+	FOREACH(t, threads)
+		threads[t].start(ProcessRowBlocksTmp, &datas[t+1]);
+	ProcessRowBlocksTmp(&datas.First());
+	FOREACHPTR(pThread, threads)
+		pThread->join();
+} // ProcessRowBlocks
+
+// register a depth-map filter job for its lifetime and compute the number of threads it can use:
+// if only a few depth-maps are filtered concurrently, the idle cores process the rows of this depth-map;
+// a depth-map estimated meanwhile uses all cores too, so it counts as one more job
+namespace {
+struct FilterJob {
+	volatile Thread::safe_t& nJobs;
+	unsigned nThreads;
+	FilterJob(volatile Thread::safe_t& _nJobs, const volatile Thread::safe_t& nEstimationJobs, unsigned nMaxThreads) : nJobs(_nJobs) {
+		const Thread::safe_t nBusyJobs(Thread::safeInc(nJobs)+nEstimationJobs);
+		nThreads = MAXF(nMaxThreads/(unsigned)MAXF(nBusyJobs,(Thread::safe_t)1), 1u);
+	}
+	~FilterJob() { Thread::safeDec(nJobs); }
+};
+} // unnamed namespace
+
+// the number of threads splatting the neighbor depth-maps in FilterDepthMap():
+// each thread but the first splats in its own depth and confidence planes of the reference size,
+// so the threads are capped such that these planes do not exceed FILTER_SPLAT_MAX_MEMORY in total
+#define FILTER_SPLAT_MAX_MEMORY (256*1024*1024)
+unsigned DepthMapsData::FilterSplatThreads(unsigned nThreads, const cv::Size& size)
+{
+	const size_t bytesPlanes(MAXF((size_t)size.area()*(sizeof(Depth)+sizeof(float)), (size_t)1));
+	return MAXF(MINF(nThreads, 1u+(unsigned)(FILTER_SPLAT_MAX_MEMORY/bytesPlanes)), 1u);
+}
+// the memory of the per-thread planes used while filtering a depth-map of the given size (bytes)
+size_t DepthMapsData::FilterSplatMemory(unsigned nThreads, const cv::Size& size)
+{
+	return (size_t)(FilterSplatThreads(nThreads, size)-1)*size.area()*(sizeof(Depth)+sizeof(float));
+}
+/*----------------------------------------------------------------*/
+
+
+// filter out small depth segments from the given depth map:
+// the segments of similar depths are labeled using a union-find scan of the rows,
+// done in parallel on strips of rows, merged at the end along the strip borders
 bool DepthMapsData::RemoveSmallSegments(DepthData& depthData)
 {
 	const float fDepthDiffThreshold(OPTDENSE::fDepthDiffThreshold*0.7f);
-	unsigned speckle_size = OPTDENSE::nSpeckleSize;
+	const unsigned speckle_size = OPTDENSE::nSpeckleSize;
 	DepthMap& depthMap = depthData.depthMap;
 	NormalMap& normalMap = depthData.normalMap;
 	ConfidenceMap& confMap = depthData.confMap;
 	ASSERT(!depthMap.empty());
 	const ImageRef size(depthMap.size());
+	const uint32_t area((uint32_t)size.x*(uint32_t)size.y);
 
-	// allocate memory on heap for dynamic programming arrays
-	TImage<bool> done_map(size, false);
-	CAutoPtrArr<ImageRef> seg_list(new ImageRef[size.x*size.y]);
-	unsigned seg_list_count;
-	unsigned seg_list_curr;
-	ImageRef neighbor[4];
-
-	// for all pixels do
-	for (int u=0; u<size.x; ++u) {
-		for (int v=0; v<size.y; ++v) {
-			// if the first pixel in this segment has been already processed => skip
-			if (done_map(v,u))
-				continue;
-
-			// init segment list (add first element
-			// and set it to be the next element to check)
-			seg_list[0] = ImageRef(u,v);
-			seg_list_count = 1;
-			seg_list_curr  = 0;
-
-			// add neighboring segments as long as there
-			// are none-processed pixels in the seg_list;
-			// none-processed means: seg_list_curr<seg_list_count
-			while (seg_list_curr < seg_list_count) {
-				// get address of current pixel in this segment
-				const ImageRef addr_curr(seg_list[seg_list_curr]);
-				const Depth& depth_curr = depthMap(addr_curr);
-
-				if (depth_curr>0) {
-					// fill list with neighbor positions
-					neighbor[0] = ImageRef(addr_curr.x-1, addr_curr.y  );
-					neighbor[1] = ImageRef(addr_curr.x+1, addr_curr.y  );
-					neighbor[2] = ImageRef(addr_curr.x  , addr_curr.y-1);
-					neighbor[3] = ImageRef(addr_curr.x  , addr_curr.y+1);
-
-					// for all neighbors do
-					for (int i=0; i<4; ++i) {
-						// get neighbor pixel address
-						const ImageRef& addr_neighbor(neighbor[i]);
-						// check if neighbor is inside image
-						if (addr_neighbor.x>=0 && addr_neighbor.y>=0 && addr_neighbor.x<size.x && addr_neighbor.y<size.y) {
-							// check if neighbor has not been added yet
-							bool& done = done_map(addr_neighbor);
-							if (!done) {
-								// check if the neighbor is valid and similar to the current pixel
-								// (belonging to the current segment)
-								const Depth& depth_neighbor = depthMap(addr_neighbor);
-								if (depth_neighbor>0 && IsDepthSimilar(depth_curr, depth_neighbor, fDepthDiffThreshold)) {
-									// add neighbor coordinates to segment list
-									seg_list[seg_list_count++] = addr_neighbor;
-									// set neighbor pixel in done_map to "done"
-									// (otherwise a pixel may be added 2 times to the list, as
-									//  neighbor of one pixel and as neighbor of another pixel)
-									done = true;
-								}
-							}
-						}
-					}
-				}
+	// segment forest: each pixel points to its parent, the root being the segment label;
+	// the buffers are kept between calls and released together with the depth-maps data
+	std::vector<uint32_t> buffer;
+	{
+		Lock l(csSegmentBuffers);
+		if (!segmentBuffers.empty()) {
+			buffer.swap(segmentBuffers.back());
+			segmentBuffers.pop_back();
+		}
+	}
+	buffer.resize((size_t)area*2);
+	// same directional test as the original flood-fill, from the already visited pixel to the next one
+	const auto IsSimilar = [fDepthDiffThreshold](Depth dVisited, Depth d) -> bool {
+		return IsDepthSimilar(dVisited, d, fDepthDiffThreshold);
+	};
+	// (the forest is passed explicitly, as it is also used as the segment sizes at the end)
+	const auto FindRoot = [](uint32_t* forest, uint32_t idx) -> uint32_t {
+		while (forest[idx] != idx) {
+			// path halving
+			forest[idx] = forest[forest[idx]];
+			idx = forest[idx];
+		}
+		return idx;
+	};
+	const auto Union = [&FindRoot](uint32_t* forest, uint32_t idx0, uint32_t idx1) {
+		idx0 = FindRoot(forest, idx0);
+		idx1 = FindRoot(forest, idx1);
+		// the segment label is always the smallest pixel index
+		if (idx0 < idx1)
+			forest[idx1] = idx0;
+		else if (idx1 < idx0)
+			forest[idx0] = idx1;
+	};
+	uint32_t* const pParents(buffer.data());
+	uint32_t* const pLabels(pParents+area);
+
+	// 1. connect each valid pixel to its left and top neighbors, on each strip independently
+	const FilterJob filterJob(nFilterJobs, nEstimationJobs, scene.nMaxThreads);
+	const unsigned nThreads(filterJob.nThreads);
+	const int nRowsStrip(MAXF((size.y+(int)nThreads-1)/(int)nThreads, 16));
+	ProcessRowBlocks(size.y, nRowsStrip, nThreads, [&](int rowBegin, int rowEnd, unsigned) {
+		for (int v=rowBegin; v<rowEnd; ++v) {
+			const Depth* const depths(depthMap.ptr<const Depth>(v));
+			for (int u=0; u<size.x; ++u) {
+				const uint32_t idx((uint32_t)v*size.x+u);
+				pParents[idx] = idx;
+				const Depth depth(depths[u]);
+				if (depth <= 0)
+					continue;
+				if (u > 0 && depths[u-1] > 0 && IsSimilar(depths[u-1], depth))
+					Union(pParents, idx-1, idx);
+				if (v > rowBegin && depths[u-size.x] > 0 && IsSimilar(depths[u-size.x], depth))
+					Union(pParents, idx-size.x, idx);
+			}
+		}
+	});
 
-				// set current pixel in seg_list to "done"
-				++seg_list_curr;
+	// 2. merge the segments across the strip borders
+	for (int v=nRowsStrip; v<size.y; v+=nRowsStrip) {
+		const Depth* const depths(depthMap.ptr<const Depth>(v));
+		for (int u=0; u<size.x; ++u) {
+			const Depth depth(depths[u]);
+			if (depth > 0 && depths[u-size.x] > 0 && IsSimilar(depths[u-size.x], depth)) {
+				const uint32_t idx((uint32_t)v*size.x+u);
+				Union(pParents, idx-size.x, idx);
+			}
+		}
+	}
 
-				// set current pixel in done_map to "done"
-				done_map(addr_curr) = true;
-			} // end: while (seg_list_curr < seg_list_count)
+	// 3. label each pixel with the root of its segment
+	ProcessRowBlocks(size.y, nRowsStrip, nThreads, [&](int rowBegin, int rowEnd, unsigned) {
+		const uint32_t idxEnd((uint32_t)rowEnd*size.x);
+		for (uint32_t idx=(uint32_t)rowBegin*size.x; idx<idxEnd; ++idx) {
+			// the forest is shared between threads, so do not compress the paths
+			uint32_t idxRoot(idx);
+			while (pParents[idxRoot] != idxRoot)
+				idxRoot = pParents[idxRoot];
+			pLabels[idx] = idxRoot;
+		}
+	});
 
-			// if segment NOT large enough => invalidate pixels
-			if (seg_list_count < speckle_size) {
-				// for all pixels in current segment invalidate pixels
-				for (unsigned i=0; i<seg_list_count; ++i) {
-					depthMap(seg_list[i]) = 0;
-					if (!normalMap.empty()) normalMap(seg_list[i]) = Normal::ZERO;
-					if (!confMap.empty()) confMap(seg_list[i]) = 0;
-				}
+	// 4. count the size of each segment
+	memset(pParents, 0, sizeof(uint32_t)*area);
+	uint32_t* const pSizes(pParents);
+	for (uint32_t idx=0; idx<area; ++idx)
+		++pSizes[pLabels[idx]];
+
+	// 5. invalidate the pixels of the segments not large enough
+	ProcessRowBlocks(size.y, nRowsStrip, nThreads, [&](int rowBegin, int rowEnd, unsigned) {
+		for (int v=rowBegin; v<rowEnd; ++v) {
+			for (int u=0; u<size.x; ++u) {
+				if (pSizes[pLabels[(uint32_t)v*size.x+u]] >= speckle_size)
+					continue;
+				depthMap(v,u) = 0;
+				if (!normalMap.empty()) normalMap(v,u) = Normal::ZERO;
+				if (!confMap.empty()) confMap(v,u) = 0;
 			}
 		}
-	}
+	});
 
+	// give back the buffers for the next call
+	Lock l(csSegmentBuffers);
+	segmentBuffers.emplace_back(std::move(buffer));
 	return true;
 } // RemoveSmallSegments
 /*----------------------------------------------------------------*/
 
-// try to fill small gaps in the depth map
+// try to fill small gaps in the depth map:
+// the rows and next the columns are processed in parallel, the columns in bands
+// walked down together, so that the memory is accessed one row at a time
 bool DepthMapsData::GapInterpolation(DepthData& depthData)
 {
 	const float fDepthDiffThreshold(OPTDENSE::fDepthDiffThreshold*2.5f);
-	unsigned nIpolGapSize = OPTDENSE::nIpolGapSize;
+	const unsigned nIpolGapSize = OPTDENSE::nIpolGapSize;
 	DepthMap& depthMap = depthData.depthMap;
 	NormalMap& normalMap = depthData.normalMap;
 	ConfidenceMap& confMap = depthData.confMap;
 	ASSERT(!depthMap.empty());
 	const ImageRef size(depthMap.size());
+	const FilterJob filterJob(nFilterJobs, nEstimationJobs, scene.nMaxThreads);
+	const unsigned nThreads(filterJob.nThreads);
+
+	// fill the gap of the given size between the two valid pixels, if their depths are similar
+	const auto InterpolateGap = [&](const ImageRef& x_first, const ImageRef& x, const ImageRef& x_step, unsigned count) {
+		// compute mean depth
+		const Depth& depthFirst = depthMap(x_first);
+		const Depth& depth = depthMap(x);
+		if (!IsDepthSimilar(depthFirst, depth, fDepthDiffThreshold))
+			return;
+		// interpolate values
+		ImageRef x_curr(x_first+x_step);
+		const Depth diff((depth-depthFirst)/(count+1));
+		Depth d(depthFirst);
+		const float c(confMap.empty() ? 0.f : MINF(confMap(x_first), confMap(x)));
+		if (normalMap.empty()) {
+			do {
+				depthMap(x_curr) = (d+=diff);
+				if (!confMap.empty()) confMap(x_curr) = c;
+			} while ((x_curr+=x_step) != x);
+		} else {
+			Point2f dir1, dir2;
+			Normal2Dir(normalMap(x_first), dir1);
+			Normal2Dir(normalMap(x), dir2);
+			const Point2f dirDiff((dir2-dir1)/float(count+1));
+			do {
+				depthMap(x_curr) = (d+=diff);
+				dir1 += dirDiff;
+				Dir2Normal(dir1, normalMap(x_curr));
+				if (!confMap.empty()) confMap(x_curr) = c;
+			} while ((x_curr+=x_step) != x);
+		}
+	};
 
 	// 1. Row-wise:
 	// for each row do
-	for (int v=0; v<size.y; ++v) {
-		// init counter
-		unsigned count = 0;
-
-		// for each element of the row do
-		for (int u=0; u<size.x; ++u) {
-			// get depth of this location
-			const Depth& depth = depthMap(v,u);
+	ProcessRowBlocks(size.y, 16, nThreads, [&](int rowBegin, int rowEnd, unsigned) {
+		for (int v=rowBegin; v<rowEnd; ++v) {
+			// init counter
+			unsigned count = 0;
+
+			// for each element of the row do
+			for (int u=0; u<size.x; ++u) {
+				// if depth not valid => count and skip it
+				if (depthMap(v,u) <= 0) {
+					++count;
+					continue;
+				}
+				if (count == 0)
+					continue;
 
-			// if depth not valid => count and skip it
-			if (depth <= 0) {
-				++count;
-				continue;
-			}
-			if (count == 0)
-				continue;
+				// check if speckle is small enough
+				// and value in range
+				if (count <= nIpolGapSize && (unsigned)u > count)
+					InterpolateGap(ImageRef(u-count-1,v), ImageRef(u,v), ImageRef(1,0), count);
 
-			// check if speckle is small enough
-			// and value in range
-			if (count <= nIpolGapSize && (unsigned)u > count) {
-				// first value index for interpolation
-				int u_curr(u-count);
-				const int u_first(u_curr-1);
-				// compute mean depth
-				const Depth& depthFirst = depthMap(v,u_first);
-				if (IsDepthSimilar(depthFirst, depth, fDepthDiffThreshold)) {
-					#if 0
-					// set all values with the average
-					const Depth avg((depthFirst+depth)*0.5f);
-					do {
-						depthMap(v,u_curr) = avg;
-					} while (++u_curr<u);						
-					#else
-					// interpolate values
-					const Depth diff((depth-depthFirst)/(count+1));
-					Depth d(depthFirst);
-					const float c(confMap.empty() ? 0.f : MINF(confMap(v,u_first), confMap(v,u)));
-					if (normalMap.empty()) {
-						do {
-							depthMap(v,u_curr) = (d+=diff);
-							if (!confMap.empty()) confMap(v,u_curr) = c;
-						} while (++u_curr<u);						
-					} else {
-						Point2f dir1, dir2;
-						Normal2Dir(normalMap(v,u_first), dir1);
-						Normal2Dir(normalMap(v,u), dir2);
-						const Point2f dirDiff((dir2-dir1)/float(count+1));
-						do {
-							depthMap(v,u_curr) = (d+=diff);
-							dir1 += dirDiff;
-							Dir2Normal(dir1, normalMap(v,u_curr));
-							if (!confMap.empty()) confMap(v,u_curr) = c;
-						} while (++u_curr<u);						
-					}
-					#endif
-				}
+				// reset counter
+				count = 0;
 			}
-
-			// reset counter
-			count = 0;
 		}
-	}
+	});
 
 	// 2. Column-wise:
-	// for each column do
-	for (int u=0; u<size.x; ++u) {
+	// for each band of columns do
+	const int nColsBand(64);
+	ProcessRowBlocks(size.x, nColsBand, nThreads, [&](int colBegin, int colEnd, unsigned) {
+		// init counters
+		unsigned counts[nColsBand] = {0};
 
-		// init counter
-		unsigned count = 0;
-
-		// for each element of the column do
+		// for each row of the band do
 		for (int v=0; v<size.y; ++v) {
-			// get depth of this location
-			const Depth& depth = depthMap(v,u);
-
-			// if depth not valid => count and skip it
-			if (depth <= 0) {
-				++count;
-				continue;
-			}
-			if (count == 0)
-				continue;
+			const Depth* const depths(depthMap.ptr<const Depth>(v));
+			for (int u=colBegin; u<colEnd; ++u) {
+				unsigned& count = counts[u-colBegin];
 
-			// check if gap is small enough
-			// and value in range
-			if (count <= nIpolGapSize && (unsigned)v > count) {
-				// first value index for interpolation
-				int v_curr(v-count);
-				const int v_first(v_curr-1);
-				// compute mean depth
-				const Depth& depthFirst = depthMap(v_first,u);
-				if (IsDepthSimilar(depthFirst, depth, fDepthDiffThreshold)) {
-					#if 0
-					// set all values with the average
-					const Depth avg((depthFirst+depth)*0.5f);
-					do {
-						depthMap(v_curr,u) = avg;
-					} while (++v_curr<v);						
-					#else
-					// interpolate values
-					const Depth diff((depth-depthFirst)/(count+1));
-					Depth d(depthFirst);
-					const float c(confMap.empty() ? 0.f : MINF(confMap(v_first,u), confMap(v,u)));
-					if (normalMap.empty()) {
-						do {
-							depthMap(v_curr,u) = (d+=diff);
-							if (!confMap.empty()) confMap(v_curr,u) = c;
-						} while (++v_curr<v);						
-					} else {
-						Point2f dir1, dir2;
-						Normal2Dir(normalMap(v_first,u), dir1);
-						Normal2Dir(normalMap(v,u), dir2);
-						const Point2f dirDiff((dir2-dir1)/float(count+1));
-						do {
-							depthMap(v_curr,u) = (d+=diff);
-							dir1 += dirDiff;
-							Dir2Normal(dir1, normalMap(v_curr,u));
-							if (!confMap.empty()) confMap(v_curr,u) = c;
-						} while (++v_curr<v);						
-					}
-					#endif
+				// if depth not valid => count and skip it
+				if (depths[u] <= 0) {
+					++count;
+					continue;
 				}
-			}
+				if (count == 0)
+					continue;
+
+				// check if gap is small enough
+				// and value in range
+				if (count <= nIpolGapSize && (unsigned)v > count)
+					InterpolateGap(ImageRef(u,v-count-1), ImageRef(u,v), ImageRef(0,1), count);
 
-			// reset counter
-			count = 0;
+				// reset counter
+				count = 0;
+			}
 		}
-	}
+	});
 	return true;
 } // GapInterpolation
 /*----------------------------------------------------------------*/
@@ -853,219 +1063,302 @@ bool DepthMapsData::FilterDepthMap(DepthData& depthDataRef, const IIndexArr& idx
 		return false;
 	}
 
-	// project all neighbor depth-maps to this image
+	const FilterJob filterJob(nFilterJobs, nEstimationJobs, scene.nMaxThreads);
+	const unsigned nThreads(filterJob.nThreads);
+	const int nRowsBlock(16);
+
+	// the agreement of each neighbor with the reference depths is accumulated per pixel
+	// as soon as the neighbor depth-map is projected, so only one projected depth-map
+	// is kept in memory, instead of one for each neighbor
+	struct AdjustAccum {
+		Depth avgDepth; // sum of the similar depths weighted by their confidence
+		float posConf, negConf; // confidence of the similar and of the conflicting depths
+		uint8_t nPosViews, nNegViews; // number of neighbors with similar and conflicting depths
+	};
+	struct CheckAccum {
+		uint8_t nGoodViews, nViews; // number of neighbors projected to this pixel and of those agreeing with it
+		uint8_t nGoodViewsDelta, nViewsDelta; // same for the neighbors projected around this pixel
+	};
 	const DepthData::ViewData& imageRef = depthDataRef.images.First();
 	const Image8U::Size sizeRef(depthDataRef.depthMap.size());
 	const Camera& cameraRef = imageRef.camera;
-	DepthMapArr depthMaps(N);
-	ConfidenceMapArr confMaps(N);
-	FOREACH(n, depthMaps) {
-		DepthMap& depthMap = depthMaps[n];
-		depthMap.create(sizeRef);
-		depthMap.memset(0);
-		ConfidenceMap& confMap = confMaps[n];
+	const float thDepthDiff(OPTDENSE::fDepthDiffThreshold*1.2f);
+	const float thDepthDiffStrict(OPTDENSE::fDepthDiffThreshold*0.8f);
+	const unsigned nDeltas(4);
+	const ImageRef xDs[nDeltas] = { ImageRef(-1,0), ImageRef(1,0), ImageRef(0,-1), ImageRef(0,1) };
+	std::vector<AdjustAccum> adjustAccums;
+	std::vector<CheckAccum> checkAccums;
+	if (bAdjust) {
+		adjustAccums.resize(sizeRef.area());
+		for (int i=0; i<sizeRef.height; ++i) {
+			for (int j=0; j<sizeRef.width; ++j) {
+				AdjustAccum& accum = adjustAccums[i*sizeRef.width+j];
+				accum.posConf = depthDataRef.confMap(i,j);
+				accum.avgDepth = depthDataRef.depthMap(i,j)*accum.posConf;
+				accum.negConf = 0;
+				accum.nPosViews = accum.nNegViews = 0;
+			}
+		}
+	} else {
+		checkAccums.resize(sizeRef.area());
+		memset(checkAccums.data(), 0, sizeof(CheckAccum)*checkAccums.size());
+	}
+
+	// project the neighbor depth-maps to this image, one at a time;
+	// the rows of the neighbor depth-map are split between the threads,
+	// each splatting in its own z-buffer, merged at the end keeping the closest depth
+	// (the number of these threads is capped by the memory of their z-buffers)
+	const unsigned nThreadsSplat(FilterSplatThreads(nThreads, sizeRef));
+	DepthMap depthMap(sizeRef);
+	ConfidenceMap confMap;
+	if (bAdjust)
+		confMap.create(sizeRef);
+	DepthMapArr threadDepthMaps(nThreadsSplat-1);
+	ConfidenceMapArr threadConfMaps(bAdjust ? nThreadsSplat-1 : 0);
+	FOREACH(t, threadDepthMaps) {
+		threadDepthMaps[t].create(sizeRef);
+		threadDepthMaps[t].memset(0);
 		if (bAdjust) {
-			confMap.create(sizeRef);
-			confMap.memset(0);
+			threadConfMaps[t].create(sizeRef);
+			threadConfMaps[t].memset(0);
 		}
-		const IIndex idxView = depthDataRef.neighbors[idxNeighbors[(IIndex)n]].idx.ID;
+	}
+	// process the neighbors in reverse order, keeping the order the confidences were always summed in
+	RFOREACH(n, idxNeighbors) {
+		depthMap.memset(0);
+		if (bAdjust)
+			confMap.memset(0);
+		const IIndex idxView = depthDataRef.neighbors[idxNeighbors[n]].idx.ID;
 		const DepthData& depthData = arrDepthData[idxView];
 		const Camera& camera = depthData.images.First().camera;
 		const Image8U::Size size(depthData.depthMap.size());
-		for (int i=0; i<size.height; ++i) {
-			for (int j=0; j<size.width; ++j) {
-				const ImageRef x(j,i);
-				const Depth depth(depthData.depthMap(x));
-				if (depth == 0)
-					continue;
-				ASSERT(depth > 0);
-				const Point3 X(camera.TransformPointI2W(Point3(x.x,x.y,depth)));
-				const Point3 camX(cameraRef.TransformPointW2C(X));
-				if (camX.z <= 0)
-					continue;
-				#if 0
-				// set depth on the rounded image projection only
-				const ImageRef xRef(ROUND2INT(cameraRef.TransformPointC2I(camX)));
-				if (!depthMap.isInside(xRef))
-					continue;
-				Depth& depthRef(depthMap(xRef));
-				if (depthRef != 0 && depthRef < camX.z)
-					continue;
-				depthRef = camX.z;
-				if (bAdjust)
-					confMap(xRef) = depthData.confMap(x);
-				#else
-				// set depth on the 4 pixels around the image projection
-				const Point2 imgX(cameraRef.TransformPointC2I(camX));
-				const ImageRef xRefs[4] = {
-					ImageRef(FLOOR2INT(imgX.x), FLOOR2INT(imgX.y)),
-					ImageRef(FLOOR2INT(imgX.x), CEIL2INT(imgX.y)),
-					ImageRef(CEIL2INT(imgX.x), FLOOR2INT(imgX.y)),
-					ImageRef(CEIL2INT(imgX.x), CEIL2INT(imgX.y))
-				};
-				for (int p=0; p<4; ++p) {
-					const ImageRef& xRef = xRefs[p];
-					if (!depthMap.isInside(xRef))
+		// the image to image transform: z*[xRef,yRef,1] = depth*H*[x,y,1] + h
+		const Matrix3x3 H(cameraRef.K*cameraRef.R*camera.R.t()*Matrix3x3(camera.K.inv()));
+		const Point3 h(cameraRef.K*(cameraRef.R*(camera.C-cameraRef.C)));
+		const float Hf[9] = {
+			(float)H(0,0), (float)H(0,1), (float)H(0,2),
+			(float)H(1,0), (float)H(1,1), (float)H(1,2),
+			(float)H(2,0), (float)H(2,1), (float)H(2,2)
+		};
+		const float hf[3] = {(float)h.x, (float)h.y, (float)h.z};
+		const auto ProjectRows = [&](int rowBegin, int rowEnd, unsigned idxThread) {
+			DepthMap& depthMapT = (idxThread == 0 ? depthMap : threadDepthMaps[idxThread-1]);
+			ConfidenceMap& confMapT = (idxThread == 0 || !bAdjust ? confMap : threadConfMaps[idxThread-1]);
+			std::vector<float> projs(size.width*3);
+			float* const xs = projs.data();
+			float* const ys = xs+size.width;
+			float* const zs = ys+size.width;
+			for (int i=rowBegin; i<rowEnd; ++i) {
+				const Depth* const depths = depthData.depthMap.ptr<const Depth>(i);
+				// transform all pixels of the row at once (vectorized by the compiler)
+				const float rx(Hf[1]*i+Hf[2]), ry(Hf[4]*i+Hf[5]), rz(Hf[7]*i+Hf[8]);
+				for (int j=0; j<size.width; ++j) {
+					const float d(depths[j]);
+					xs[j] = (Hf[0]*j+rx)*d + hf[0];
+					ys[j] = (Hf[3]*j+ry)*d + hf[1];
+					zs[j] = (Hf[6]*j+rz)*d + hf[2];
+				}
+				for (int j=0; j<size.width; ++j) {
+					const Depth depth(depths[j]);
+					if (depth == 0)
 						continue;
-					Depth& depthRef(depthMap(xRef));
-					if (depthRef != 0 && depthRef < (Depth)camX.z)
+					ASSERT(depth > 0);
+					const Depth z(zs[j]);
+					if (z <= 0)
 						continue;
-					depthRef = (Depth)camX.z;
-					if (bAdjust)
-						confMap(xRef) = depthData.confMap(x);
+					// set depth on the 4 pixels around the image projection
+					const Point2f imgX(xs[j]/z, ys[j]/z);
+					const ImageRef xRefs[4] = {
+						ImageRef(FLOOR2INT(imgX.x), FLOOR2INT(imgX.y)),
+						ImageRef(FLOOR2INT(imgX.x), CEIL2INT(imgX.y)),
+						ImageRef(CEIL2INT(imgX.x), FLOOR2INT(imgX.y)),
+						ImageRef(CEIL2INT(imgX.x), CEIL2INT(imgX.y))
+					};
+					for (int p=0; p<4; ++p) {
+						const ImageRef& xRef = xRefs[p];
+						if (!depthMapT.isInside(xRef))
+							continue;
+						Depth& depthRef(depthMapT(xRef));
+						if (depthRef != 0 && depthRef < z)
+							continue;
+						depthRef = z;
+						if (bAdjust)
+							confMapT(xRef) = depthData.confMap(i,j);
+					}
 				}
-				#endif
 			}
+		};
+		ProcessRowBlocks(size.height, nRowsBlock, nThreadsSplat, ProjectRows);
+		if (nThreadsSplat > 1) {
+			// merge the z-buffers of all threads, and reset them for the next neighbor
+			ProcessRowBlocks(sizeRef.height, nRowsBlock, nThreads, [&](int rowBegin, int rowEnd, unsigned) {
+				for (int i=rowBegin; i<rowEnd; ++i) {
+					for (int j=0; j<sizeRef.width; ++j) {
+						Depth& depthRef = depthMap(i,j);
+						FOREACH(t, threadDepthMaps) {
+							Depth& depth = threadDepthMaps[t](i,j);
+							if (depth == 0)
+								continue;
+							if (depthRef == 0 || depth < depthRef) {
+								depthRef = depth;
+								if (bAdjust)
+									confMap(i,j) = threadConfMaps[t](i,j);
+							}
+							depth = 0;
+						}
+					}
+				}
+			});
 		}
 		#if TD_VERBOSE != TD_VERBOSE_OFF
 		if (g_nVerbosityLevel > 3)
 			ExportDepthMap(MAKE_PATH(String::FormatString("depthRender%04u.%04u.png", depthDataRef.GetView().GetID(), idxView)), depthMap);
 		#endif
+		// accumulate the agreement of this neighbor with the reference depths
+		ProcessRowBlocks(sizeRef.height, nRowsBlock, nThreads, [&](int rowBegin, int rowEnd, unsigned) {
+			for (int i=rowBegin; i<rowEnd; ++i) {
+				for (int j=0; j<sizeRef.width; ++j) {
+					const ImageRef xRef(j,i);
+					const Depth depth(depthDataRef.depthMap(xRef));
+					if (depth == 0)
+						continue;
+					ASSERT(depth > 0);
+					if (bAdjust) {
+						// update best depth and confidence estimate with this estimate
+						const Depth d(depthMap(xRef));
+						if (d == 0)
+							continue;
+						ASSERT(d > 0);
+						AdjustAccum& accum = adjustAccums[i*sizeRef.width+j];
+						if (IsDepthSimilar(depth, d, thDepthDiff)) {
+							// average similar depths
+							const float c(confMap(xRef));
+							accum.avgDepth += d*c;
+							accum.posConf += c;
+							++accum.nPosViews;
+						} else {
+							// penalize confidence
+							if (depth > d) {
+								// occlusion
+								accum.negConf += confMap(xRef);
+							} else {
+								// free-space violation
+								const Point3 X(cameraRef.TransformPointI2W(Point3(xRef.x,xRef.y,depth)));
+								const ImageRef x(ROUND2INT(camera.TransformPointW2I(X)));
+								if (depthData.confMap.isInside(x)) {
+									const float c(depthData.confMap(x));
+									accum.negConf += (c > 0 ? c : confMap(xRef));
+								} else
+									accum.negConf += confMap(xRef);
+							}
+							++accum.nNegViews;
+						}
+					} else {
+						CheckAccum& accum = checkAccums[i*sizeRef.width+j];
+						// check if very similar with the neighbor projected to this pixel
+						const Depth d(depthMap(xRef));
+						if (d > 0) {
+							// valid view
+							++accum.nViews;
+							if (IsDepthSimilar(depth, d, thDepthDiffStrict)) {
+								// agrees with this neighbor
+								++accum.nGoodViews;
+							}
+						}
+						// check if similar with the neighbor projected around this pixel
+						for (unsigned k=0; k<nDeltas; ++k) {
+							const ImageRef xDRef(xRef+xDs[k]);
+							if (!depthMap.isInside(xDRef))
+								continue;
+							const Depth d(depthMap(xDRef));
+							if (d > 0) {
+								// valid view
+								++accum.nViewsDelta;
+								if (IsDepthSimilar(depth, d, thDepthDiff)) {
+									// agrees with this neighbor
+									++accum.nGoodViewsDelta;
+								}
+							}
+						}
+					}
+				}
+			}
+		});
 	}
+	threadDepthMaps.Release();
+	threadConfMaps.Release();
+	depthMap.release();
+	confMap.release();
 
-	const float thDepthDiff(OPTDENSE::fDepthDiffThreshold*1.2f);
 	DepthMap newDepthMap(sizeRef);
 	ConfidenceMap newConfMap(sizeRef);
 	#if TD_VERBOSE != TD_VERBOSE_OFF
-	size_t nProcessed(0), nDiscarded(0);
+	CLISTDEF0(size_t) nProcessedThreads(nThreads), nDiscardedThreads(nThreads);
+	nProcessedThreads.Memset(0);
+	nDiscardedThreads.Memset(0);
 	#endif
 	if (bAdjust) {
 		// average similar depths, and decrease confidence if depths do not agree
 		// (inspired by: "Real-Time Visibility-Based Fusion of Depth Maps", Merrell, 2007)
-		for (int i=0; i<sizeRef.height; ++i) {
-			for (int j=0; j<sizeRef.width; ++j) {
-				const ImageRef xRef(j,i);
-				const Depth depth(depthDataRef.depthMap(xRef));
-				if (depth == 0) {
-					newDepthMap(xRef) = 0;
-					newConfMap(xRef) = 0;
-					continue;
-				}
-				ASSERT(depth > 0);
-				#if TD_VERBOSE != TD_VERBOSE_OFF
-				++nProcessed;
-				#endif
-				// update best depth and confidence estimate with all estimates
-				float posConf(depthDataRef.confMap(xRef)), negConf(0);
-				Depth avgDepth(depth*posConf);
-				unsigned nPosViews(0), nNegViews(0);
-				unsigned n(N);
-				do {
-					const Depth d(depthMaps[--n](xRef));
-					if (d == 0) {
-						if (nPosViews + nNegViews + n < nMinViews)
-							goto DiscardDepth;
+		ProcessRowBlocks(sizeRef.height, nRowsBlock, nThreads, [&](int rowBegin, int rowEnd, unsigned idxThread) {
+			#if TD_VERBOSE != TD_VERBOSE_OFF
+			size_t& nProcessed = nProcessedThreads[idxThread];
+			size_t& nDiscarded = nDiscardedThreads[idxThread];
+			#endif
+			for (int i=rowBegin; i<rowEnd; ++i) {
+				for (int j=0; j<sizeRef.width; ++j) {
+					const ImageRef xRef(j,i);
+					const Depth depth(depthDataRef.depthMap(xRef));
+					if (depth == 0) {
+						newDepthMap(xRef) = 0;
+						newConfMap(xRef) = 0;
 						continue;
 					}
-					ASSERT(d > 0);
-					if (IsDepthSimilar(depth, d, thDepthDiff)) {
-						// average similar depths
-						const float c(confMaps[n](xRef));
-						avgDepth += d*c;
-						posConf += c;
-						++nPosViews;
-					} else {
-						// penalize confidence
-						if (depth > d) {
-							// occlusion
-							negConf += confMaps[n](xRef);
-						} else {
-							// free-space violation
-							const DepthData& depthData = arrDepthData[depthDataRef.neighbors[idxNeighbors[n]].idx.ID];
-							const Camera& camera = depthData.images.First().camera;
-							const Point3 X(cameraRef.TransformPointI2W(Point3(xRef.x,xRef.y,depth)));
-							const ImageRef x(ROUND2INT(camera.TransformPointW2I(X)));
-							if (depthData.confMap.isInside(x)) {
-								const float c(depthData.confMap(x));
-								negConf += (c > 0 ? c : confMaps[n](xRef));
-							} else
-								negConf += confMaps[n](xRef);
-						}
-						++nNegViews;
-					}
-				} while (n);
-				ASSERT(nPosViews+nNegViews >= nMinViews);
-				// if enough good views and positive confidence...
-				if (nPosViews >= nMinViewsAdjust && posConf > negConf && ISINSIDE(avgDepth/=posConf, depthDataRef.dMin, depthDataRef.dMax)) {
-					// consider this pixel an inlier
-					newDepthMap(xRef) = avgDepth;
-					newConfMap(xRef) = posConf - negConf;
-				} else {
-					// consider this pixel an outlier
-					DiscardDepth:
-					newDepthMap(xRef) = 0;
-					newConfMap(xRef) = 0;
 					#if TD_VERBOSE != TD_VERBOSE_OFF
-					++nDiscarded;
+					++nProcessed;
 					#endif
+					AdjustAccum& accum = adjustAccums[i*sizeRef.width+j];
+					// if enough good views and positive confidence...
+					if (accum.nPosViews+accum.nNegViews >= nMinViews && accum.nPosViews >= nMinViewsAdjust &&
+						accum.posConf > accum.negConf && ISINSIDE(accum.avgDepth/=accum.posConf, depthDataRef.dMin, depthDataRef.dMax)) {
+						// consider this pixel an inlier
+						newDepthMap(xRef) = accum.avgDepth;
+						newConfMap(xRef) = accum.posConf - accum.negConf;
+					} else {
+						// consider this pixel an outlier
+						newDepthMap(xRef) = 0;
+						newConfMap(xRef) = 0;
+						#if TD_VERBOSE != TD_VERBOSE_OFF
+						++nDiscarded;
+						#endif
+					}
 				}
 			}
-		}
+		});
 	} else {
 		// remove depth if it does not agree with enough neighbors
-		const float thDepthDiffStrict(OPTDENSE::fDepthDiffThreshold*0.8f);
 		const unsigned nMinGoodViewsProc(75), nMinGoodViewsDeltaProc(65);
-		const unsigned nDeltas(4);
 		const unsigned nMinViewsDelta(nMinViews*(nDeltas-2));
-		const ImageRef xDs[nDeltas] = { ImageRef(-1,0), ImageRef(1,0), ImageRef(0,-1), ImageRef(0,1) };
-		for (int i=0; i<sizeRef.height; ++i) {
-			for (int j=0; j<sizeRef.width; ++j) {
-				const ImageRef xRef(j,i);
-				const Depth depth(depthDataRef.depthMap(xRef));
-				if (depth == 0) {
-					newDepthMap(xRef) = 0;
-					newConfMap(xRef) = 0;
-					continue;
-				}
-				ASSERT(depth > 0);
-				#if TD_VERBOSE != TD_VERBOSE_OFF
-				++nProcessed;
-				#endif
-				// check if very similar with the neighbors projected to this pixel
-				{
-					unsigned nGoodViews(0);
-					unsigned nViews(0);
-					unsigned n(N);
-					do {
-						const Depth d(depthMaps[--n](xRef));
-						if (d > 0) {
-							// valid view
-							++nViews;
-							if (IsDepthSimilar(depth, d, thDepthDiffStrict)) {
-								// agrees with this neighbor
-								++nGoodViews;
-							}
-						}
-					} while (n);
-					if (nGoodViews < nMinViews || nGoodViews < nViews*nMinGoodViewsProc/100) {
-						#if TD_VERBOSE != TD_VERBOSE_OFF
-						++nDiscarded;
-						#endif
+		ProcessRowBlocks(sizeRef.height, nRowsBlock, nThreads, [&](int rowBegin, int rowEnd, unsigned idxThread) {
+			#if TD_VERBOSE != TD_VERBOSE_OFF
+			size_t& nProcessed = nProcessedThreads[idxThread];
+			size_t& nDiscarded = nDiscardedThreads[idxThread];
+			#endif
+			for (int i=rowBegin; i<rowEnd; ++i) {
+				for (int j=0; j<sizeRef.width; ++j) {
+					const ImageRef xRef(j,i);
+					const Depth depth(depthDataRef.depthMap(xRef));
+					if (depth == 0) {
 						newDepthMap(xRef) = 0;
 						newConfMap(xRef) = 0;
 						continue;
 					}
-				}
-				// check if similar with the neighbors projected around this pixel
-				{
-					unsigned nGoodViews(0);
-					unsigned nViews(0);
-					for (unsigned d=0; d<nDeltas; ++d) {
-						const ImageRef xDRef(xRef+xDs[d]);
-						unsigned n(N);
-						do {
-							const Depth d(depthMaps[--n](xDRef));
-							if (d > 0) {
-								// valid view
-								++nViews;
-								if (IsDepthSimilar(depth, d, thDepthDiff)) {
-									// agrees with this neighbor
-									++nGoodViews;
-								}
-							}
-						} while (n);
-					}
-					if (nGoodViews < nMinViewsDelta || nGoodViews < nViews*nMinGoodViewsDeltaProc/100) {
+					#if TD_VERBOSE != TD_VERBOSE_OFF
+					++nProcessed;
+					#endif
+					const CheckAccum& accum = checkAccums[i*sizeRef.width+j];
+					if (accum.nGoodViews < nMinViews || accum.nGoodViews < accum.nViews*nMinGoodViewsProc/100 ||
+						accum.nGoodViewsDelta < nMinViewsDelta || accum.nGoodViewsDelta < accum.nViewsDelta*nMinGoodViewsDeltaProc/100) {
 						#if TD_VERBOSE != TD_VERBOSE_OFF
 						++nDiscarded;
 						#endif
@@ -1073,17 +1366,24 @@ bool DepthMapsData::FilterDepthMap(DepthData& depthDataRef, const IIndexArr& idx
 						newConfMap(xRef) = 0;
 						continue;
 					}
+					// enough good views, keep it
+					newDepthMap(xRef) = depth;
+					newConfMap(xRef) = depthDataRef.confMap(xRef);
 				}
-				// enough good views, keep it
-				newDepthMap(xRef) = depth;
-				newConfMap(xRef) = depthDataRef.confMap(xRef);
 			}
-		}
+		});
 	}
 	if (!SaveDepthMap(ComposeDepthFilePath(imageRef.GetID(), "filtered.dmap"), newDepthMap) ||
 		!SaveConfidenceMap(ComposeDepthFilePath(imageRef.GetID(), "filtered.cmap"), newConfMap))
 		return false;
 
+	#if TD_VERBOSE != TD_VERBOSE_OFF
+	size_t nProcessed(0), nDiscarded(0);
+	FOREACH(t, nProcessedThreads) {
+		nProcessed += nProcessedThreads[t];
+		nDiscarded += nDiscardedThreads[t];
+	}
+	#endif
 	DEBUG("Depth map %3u filtered using %u other images: %u/%u depths discarded (%s)",
 		imageRef.GetID(), N, nDiscarded, nProcessed, TD_TIMER_GET_FMT().c_str());
 	return true;
@@ -1159,8 +1459,15 @@ void DepthMapsData::MergeDepthMaps(PointCloud& pointcloud, bool bEstimateColor,
 
 // fuse all valid depth-maps in the same 3D point cloud;
 // join points very likely to represent the same 3D point and
-// filter out points blocking the view
-void DepthMapsData::FuseDepthMaps(PointCloud& pointcloud, bool bEstimateColor, bool bEstimateNormal)
+// filter out points blocking the view;
+// if pNewImages is given, the point cloud is not empty but it is the result of a previous fusion,
+// and only the depth-maps of the given images are fused: first the new depths agreeing
+// with the existing points are merged into them, and the pixels of the loaded neighbor
+// depth-maps already explained by the existing points are marked as fused,
+// next the new depth-maps are fused as usual and the new points appended to the point cloud
+// if OPTDENSE::fFusionSpacing or OPTDENSE::nFusionMaxPoints are set, the point cloud is decimated
+// while fusing, keeping in each grid cell only the sample with the highest weight
+void DepthMapsData::FuseDepthMaps(PointCloud& pointcloud, bool bEstimateColor, bool bEstimateNormal, const IIndexArr* pNewImages)
 {
 	TD_TIMER_STARTD();
 
@@ -1179,23 +1486,61 @@ void DepthMapsData::FuseDepthMaps(PointCloud& pointcloud, bool bEstimateColor, b
 	typedef SEACAVE::cList<Proj,const Proj&,0,4,uint32_t> ProjArr;
 	typedef SEACAVE::cList<ProjArr,const ProjArr&,1,65536> ProjsArr;
 
+	// spatial grid used to decimate the fused points on the fly:
+	// each cell keeps only the sample with the highest weight, merging the views of all samples
+	struct DecimationGrid {
+		std::unordered_map<GridCell,PointCloud::Index,GridCellHash> cells;
+		float cellSize;
+		float invCellSize;
+		inline void SetCellSize(float _cellSize) {
+			cellSize = _cellSize;
+			invCellSize = (_cellSize > 0 ? 1.f/_cellSize : 0.f);
+			cells.clear();
+		}
+		inline GridCell GetCell(const PointCloud::Point& X) const {
+			return GetGridCell(X, invCellSize);
+		}
+	} grid;
+	grid.SetCellSize(OPTDENSE::fFusionSpacing);
+	const PointCloud::Index nMaxPoints(OPTDENSE::nFusionMaxPoints);
+
+	// select the depth-maps to be fused (2) and the ones only loaded to be checked against (1)
+	CLISTDEF0IDX(uint8_t,IIndex) imageRoles(scene.images.GetSize());
+	if (pNewImages == NULL) {
+		FOREACH(i, scene.images)
+			imageRoles[i] = (arrDepthData[i].IsValid() ? 2 : 0);
+	} else {
+		imageRoles.Memset(0);
+		for (IIndex idxImage: *pNewImages) {
+			const DepthData& depthData = arrDepthData[idxImage];
+			if (!depthData.IsValid())
+				continue;
+			imageRoles[idxImage] = 2;
+			for (const ViewScore& neighbor: depthData.neighbors)
+				if (imageRoles[neighbor.idx.ID] == 0)
+					imageRoles[neighbor.idx.ID] = 1;
+		}
+	}
+
 	// find best connected images
 	IndexScoreArr connections(0, scene.images.GetSize());
 	size_t nPointsEstimate(0);
 	bool bNormalMap(true);
 	FOREACH(i, scene.images) {
-		DepthData& depthData = arrDepthData[i];
-		if (!depthData.IsValid())
+		if (imageRoles[i] == 0)
 			continue;
-		if (depthData.IncRef(ComposeDepthFilePath(depthData.GetView().GetID(), "dmap")) == 0)
+		DepthData& depthData = arrDepthData[i];
+		if (depthData.IncRef(ComposeDepthFilePath(scene.images[i].ID, "dmap")) == 0)
 			return;
 		ASSERT(!depthData.IsEmpty());
+		if (depthData.normalMap.empty())
+			bNormalMap = false;
+		if (imageRoles[i] == 1)
+			continue;
 		IndexScore& connection = connections.AddEmpty();
 		connection.idx = i;
 		connection.score = (float)scene.images[i].neighbors.GetSize();
 		nPointsEstimate += ROUND2INT(depthData.depthMap.area()*(0.5f/*valid*/*0.3f/*new*/));
-		if (depthData.normalMap.empty())
-			bNormalMap = false;
 	}
 	connections.Sort();
 
@@ -1207,9 +1552,30 @@ void DepthMapsData::FuseDepthMaps(PointCloud& pointcloud, bool bEstimateColor, b
 	typedef TImage<cuint32_t> DepthIndex;
 	typedef cList<DepthIndex> DepthIndexArr;
 	DepthIndexArr arrDepthIdx(scene.images.GetSize());
+	const PointCloud::Index nPointsPrev(pNewImages ? (PointCloud::Index)pointcloud.points.GetSize() : 0);
+	nPointsEstimate += nPointsPrev;
 	ProjsArr projs(0, nPointsEstimate);
 	if (bEstimateNormal && !bNormalMap)
 		bEstimateNormal = false;
+	if (nPointsPrev) {
+		// the existing point-cloud attributes must stay aligned with the new points
+		if (bEstimateColor && pointcloud.colors.GetSize() != nPointsPrev)
+			bEstimateColor = false;
+		if (bEstimateNormal && pointcloud.normals.GetSize() != nPointsPrev)
+			bEstimateNormal = false;
+		if (!bEstimateColor)
+			pointcloud.colors.Release();
+		if (!bEstimateNormal)
+			pointcloud.normals.Release();
+		if (pointcloud.pointWeights.IsEmpty()) {
+			pointcloud.pointWeights.Resize(nPointsPrev);
+			FOREACH(i, pointcloud.pointWeights) {
+				PointCloud::WeightArr& weights = pointcloud.pointWeights[i];
+				weights.Resize(pointcloud.pointViews[i].GetSize());
+				weights.MemsetValue(PointCloud::Weight(1));
+			}
+		}
+	}
 	pointcloud.points.Reserve(nPointsEstimate);
 	pointcloud.pointViews.Reserve(nPointsEstimate);
 	pointcloud.pointWeights.Reserve(nPointsEstimate);
@@ -1217,16 +1583,252 @@ void DepthMapsData::FuseDepthMaps(PointCloud& pointcloud, bool bEstimateColor, b
 		pointcloud.colors.Reserve(nPointsEstimate);
 	if (bEstimateNormal)
 		pointcloud.normals.Reserve(nPointsEstimate);
-	Util::Progress progress(_T("Fused depth-maps"), connections.GetSize());
-	GET_LOGCONSOLE().Pause();
-	FOREACHPTR(pConnection, connections) {
+	// merge the views of the fused point idxSrc into the fused point idxDst,
+	// keeping the position, color and normal of the point with the higher weight
+	const auto MergePoints = [&](PointCloud::Index idxDst, PointCloud::Index idxSrc) {
+		PointCloud::ViewArr& viewsDst = pointcloud.pointViews[idxDst];
+		PointCloud::WeightArr& weightsDst = pointcloud.pointWeights[idxDst];
+		ProjArr& projsDst = projs[idxDst];
+		const PointCloud::ViewArr& viewsSrc = pointcloud.pointViews[idxSrc];
+		const PointCloud::WeightArr& weightsSrc = pointcloud.pointWeights[idxSrc];
+		const ProjArr& projsSrc = projs[idxSrc];
+		PointCloud::Weight weightDst(0), weightSrc(0);
+		for (PointCloud::Weight w: weightsDst)
+			weightDst += w;
+		for (PointCloud::Weight w: weightsSrc)
+			weightSrc += w;
+		const bool bReplace(weightDst < weightSrc);
+		if (bReplace) {
+			pointcloud.points[idxDst] = pointcloud.points[idxSrc];
+			if (bEstimateColor)
+				pointcloud.colors[idxDst] = pointcloud.colors[idxSrc];
+			if (bEstimateNormal)
+				pointcloud.normals[idxDst] = pointcloud.normals[idxSrc];
+		}
+		FOREACH(v, viewsSrc) {
+			const uint32_t idx(viewsDst.FindFirstEqlGreater(viewsSrc[v]));
+			if (idx < viewsDst.GetSize() && viewsDst[idx] == viewsSrc[v]) {
+				weightsDst[idx] += weightsSrc[v];
+				if (bReplace)
+					projsDst[idx] = projsSrc[v];
+			} else {
+				viewsDst.InsertAt(idx, viewsSrc[v]);
+				weightsDst.InsertAt(idx, weightsSrc[v]);
+				projsDst.InsertAt(idx, projsSrc[v]);
+			}
+		}
+	};
+	// bin all fused points in the decimation grid using the given cell size,
+	// merging the points falling in the same cell and compacting the point-cloud
+	const auto RebinPoints = [&](float cellSize) {
 		TD_TIMER_STARTD();
-		const uint32_t idxImage(pConnection->idx);
-		const DepthData& depthData(arrDepthData[idxImage]);
-		ASSERT(!depthData.images.IsEmpty() && !depthData.neighbors.IsEmpty());
-		for (const ViewScore& neighbor: depthData.neighbors) {
-			DepthIndex& depthIdxs = arrDepthIdx[neighbor.idx.ID];
-			if (!depthIdxs.empty())
+		const PointCloud::Index nPoints((PointCloud::Index)pointcloud.points.GetSize());
+		grid.SetCellSize(cellSize);
+		PointCloud::Index nPointsKept(0);
+		for (PointCloud::Index idxPoint=0; idxPoint<nPoints; ++idxPoint) {
+			const auto itCell(grid.cells.emplace(grid.GetCell(pointcloud.points[idxPoint]), nPointsKept));
+			if (!itCell.second) {
+				MergePoints(itCell.first->second, idxPoint);
+				continue;
+			}
+			if (nPointsKept != idxPoint) {
+				pointcloud.points[nPointsKept] = pointcloud.points[idxPoint];
+				pointcloud.pointViews[nPointsKept].Swap(pointcloud.pointViews[idxPoint]);
+				pointcloud.pointWeights[nPointsKept].Swap(pointcloud.pointWeights[idxPoint]);
+				projs[nPointsKept].Swap(projs[idxPoint]);
+				if (bEstimateColor)
+					pointcloud.colors[nPointsKept] = pointcloud.colors[idxPoint];
+				if (bEstimateNormal)
+					pointcloud.normals[nPointsKept] = pointcloud.normals[idxPoint];
+			}
+			++nPointsKept;
+		}
+		pointcloud.points.Resize(nPointsKept);
+		pointcloud.pointViews.Resize(nPointsKept);
+		pointcloud.pointWeights.Resize(nPointsKept);
+		projs.Resize(nPointsKept);
+		if (bEstimateColor)
+			pointcloud.colors.Resize(nPointsKept);
+		if (bEstimateNormal)
+			pointcloud.normals.Resize(nPointsKept);
+		DEBUG_ULTIMATE("Fused points decimated using %g cell size: %u -> %u points (%s)", cellSize, nPoints, nPointsKept, TD_TIMER_GET_FMT().c_str());
+	};
+	// coarsen the decimation grid till the fused points fit in the points budget
+	const auto EnforcePointsBudget = [&]() {
+		if (nMaxPoints == 0 || pointcloud.points.GetSize() <= nMaxPoints)
+			return;
+		float cellSize(grid.cellSize);
+		if (cellSize <= 0) {
+			// start from the average ground sampling distance of the fused points
+			const PointCloud::Index nPoints((PointCloud::Index)pointcloud.points.GetSize());
+			const PointCloud::Index nStep(MAXF(nPoints/1024u, 1u));
+			REAL sumGSD(0);
+			unsigned nSamples(0);
+			for (PointCloud::Index idxPoint=0; idxPoint<nPoints; idxPoint+=nStep) {
+				const Camera& camera = scene.images[pointcloud.pointViews[idxPoint].First()].camera;
+				sumGSD += camera.PointDepth(pointcloud.points[idxPoint])/camera.GetFocalLength();
+				++nSamples;
+			}
+			cellSize = (float)(sumGSD/nSamples);
+			if (!(cellSize > 0) || !ISFINITE(cellSize)) {
+				VERBOSE("warning: fused points budget not enforced (invalid ground sampling distance %g)", cellSize);
+				return;
+			}
+		}
+		// coarsen till a quarter below the budget, so it is not enforced again after every depth-map,
+		// stopping if a rebin does not reduce the points anymore (ex. all points in the same cell)
+		const uint64_t nTargetPoints(MAXF((uint64_t)nMaxPoints*3/4, (uint64_t)1));
+		size_t nPointsPrev;
+		do {
+			nPointsPrev = pointcloud.points.GetSize();
+			cellSize *= float(SQRT_2);
+			RebinPoints(cellSize);
+		} while (pointcloud.points.GetSize() > nTargetPoints && pointcloud.points.GetSize() < nPointsPrev);
+	};
+
+	if (nPointsPrev) {
+		// merge the existing points with the new depths agreeing with them,
+		// and mark the depths already explained by the existing points as fused
+		TD_TIMER_STARTD();
+		FOREACH(i, scene.images)
+			if (imageRoles[i] != 0) {
+				const DepthData& depthData = arrDepthData[i];
+				DepthIndex& depthIdxs = arrDepthIdx[i];
+				depthIdxs.create(depthData.depthMap.size());
+				depthIdxs.memset((uint8_t)NO_ID);
+			}
+		// the neighbors of each new image are the only ones whose points can be merged with it
+		IIndexArr newImages;
+		cList<BoolArr> newImageNeighbors;
+		for (IIndex idxImage: *pNewImages) {
+			if (imageRoles[idxImage] != 2)
+				continue;
+			newImages.Insert(idxImage);
+			BoolArr& isNeighbor = newImageNeighbors.AddEmpty();
+			isNeighbor.Resize(scene.images.GetSize());
+			isNeighbor.Memset(0);
+			for (const ViewScore& neighbor: arrDepthData[idxImage].neighbors)
+				isNeighbor[neighbor.idx.ID] = true;
+		}
+		size_t nMerged(0);
+		projs.Resize(nPointsPrev);
+		for (PointCloud::Index idxPoint=0; idxPoint<nPointsPrev; ++idxPoint) {
+			PointCloud::Point& point = pointcloud.points[idxPoint];
+			PointCloud::ViewArr& views = pointcloud.pointViews[idxPoint];
+			PointCloud::WeightArr& weights = pointcloud.pointWeights[idxPoint];
+			ProjArr& pointProjs = projs[idxPoint];
+			pointProjs.Resize(views.GetSize());
+			// mark the pixels of the known views
+			FOREACH(v, views) {
+				const IIndex idxImageB(views[v]);
+				pointProjs[v] = Proj(0u);
+				if (imageRoles[idxImageB] == 0)
+					continue;
+				const Point3f pt(scene.images[idxImageB].camera.ProjectPointP3(point));
+				if (pt.z <= 0)
+					continue;
+				const ImageRef xB(ROUND2INT(pt.x/pt.z), ROUND2INT(pt.y/pt.z));
+				DepthIndex& depthIdxs = arrDepthIdx[idxImageB];
+				if (!depthIdxs.isInside(xB))
+					continue;
+				pointProjs[v] = Proj(xB);
+				if (arrDepthData[idxImageB].depthMap(xB) > 0)
+					depthIdxs(xB) = idxPoint;
+			}
+			// try to add the new views
+			REAL confidence(0);
+			for (PointCloud::Weight w: weights)
+				confidence += w;
+			Point3 X(point*confidence);
+			Pixel32F C(bEstimateColor ? Cast<float>(pointcloud.colors[idxPoint])*(float)confidence : Pixel32F::BLACK);
+			PointCloud::Normal N(bEstimateNormal ? pointcloud.normals[idxPoint]*(float)confidence : PointCloud::Normal::ZERO);
+			const REAL confidenceInit(confidence);
+			FOREACH(n, newImages) {
+				const IIndex idxImageB(newImages[n]);
+				if (views.FindFirst(idxImageB) != PointCloud::ViewArr::NO_INDEX)
+					continue;
+				const BoolArr& isNeighbor = newImageNeighbors[n];
+				bool bSeen(false);
+				for (const PointCloud::View view: views)
+					if (isNeighbor[view]) {
+						bSeen = true;
+						break;
+					}
+				if (!bSeen)
+					continue;
+				const Image& imageDataB = scene.images[idxImageB];
+				const Point3f pt(imageDataB.camera.ProjectPointP3(point));
+				if (pt.z <= 0)
+					continue;
+				const ImageRef xB(ROUND2INT(pt.x/pt.z), ROUND2INT(pt.y/pt.z));
+				DepthData& depthDataB = arrDepthData[idxImageB];
+				DepthMap& depthMapB = depthDataB.depthMap;
+				if (!depthMapB.isInside(xB))
+					continue;
+				Depth& depthB = depthMapB(xB);
+				if (depthB == 0)
+					continue;
+				uint32_t& idxPointB = arrDepthIdx[idxImageB](xB);
+				if (idxPointB != NO_ID)
+					continue;
+				if (IsDepthSimilar(pt.z, depthB, OPTDENSE::fDepthDiffThreshold)) {
+					const PointCloud::Normal normalB(bNormalMap ? Cast<Normal::Type>(imageDataB.camera.R.t()*Cast<REAL>(depthDataB.normalMap(xB))) : Normal(0,0,-1));
+					if (!bEstimateNormal || pointcloud.normals[idxPoint].dot(normalB) > normalError) {
+						// add view to the existing 3D point
+						const float confidenceB(Conf2Weight(depthDataB.confMap(xB),depthB));
+						const IIndex idx(views.InsertSort(idxImageB));
+						weights.InsertAt(idx, confidenceB);
+						pointProjs.InsertAt(idx, Proj(xB));
+						idxPointB = idxPoint;
+						X += imageDataB.camera.TransformPointI2W(Point3(Point2f(xB),depthB))*REAL(confidenceB);
+						if (bEstimateColor)
+							C += Cast<float>(imageDataB.image(xB))*confidenceB;
+						if (bEstimateNormal)
+							N += normalB*confidenceB;
+						confidence += confidenceB;
+						continue;
+					}
+				}
+				if (pt.z < depthB) {
+					// the existing point is in front of the new depth, discard it
+					depthB = 0;
+				}
+			}
+			if (confidence > confidenceInit) {
+				const REAL nrm(REAL(1)/confidence);
+				point = X*nrm;
+				ASSERT(ISFINITE(point));
+				if (bEstimateColor)
+					pointcloud.colors[idxPoint] = (C*(float)nrm).cast<uint8_t>();
+				if (bEstimateNormal)
+					pointcloud.normals[idxPoint] = normalized(N*(float)nrm);
+				++nMerged;
+			}
+		}
+		DEBUG_EXTRA("Existing point-cloud merged with %u new depth-maps: %u/%u points updated (%s)", newImages.GetSize(), nMerged, nPointsPrev, TD_TIMER_GET_FMT().c_str());
+	}
+	if (grid.cellSize > 0 && !pointcloud.points.IsEmpty()) {
+		// decimate also the existing points
+		RebinPoints(grid.cellSize);
+	}
+	EnforcePointsBudget();
+	fusionStats.Empty();
+	fusionStats.Reserve(connections.GetSize());
+	Util::Progress progress(_T("Fused depth-maps"), connections.GetSize());
+	GET_LOGCONSOLE().Pause();
+	FOREACHPTR(pConnection, connections) {
+		TD_TIMER_STARTD();
+		const Timer::SysType timeStart(Timer::GetSysTime());
+		const uint32_t idxImage(pConnection->idx);
+		const DepthData& depthData(arrDepthData[idxImage]);
+		ASSERT(!depthData.images.IsEmpty() && !depthData.neighbors.IsEmpty());
+		FusionStats& stats = fusionStats.AddConstruct(idxImage);
+		stats.nNeighbors = depthData.neighbors.GetSize();
+		stats.neighborMatches.Resize(stats.nNeighbors);
+		stats.neighborMatches.Memset(0);
+		for (const ViewScore& neighbor: depthData.neighbors) {
+			DepthIndex& depthIdxs = arrDepthIdx[neighbor.idx.ID];
+			if (!depthIdxs.empty())
 				continue;
 			const DepthData& depthDataB(arrDepthData[neighbor.idx.ID]);
 			if (depthDataB.IsEmpty())
@@ -1243,7 +1845,6 @@ void DepthMapsData::FuseDepthMaps(PointCloud& pointcloud, bool bEstimateColor, b
 			depthIdxs.create(Image8U::Size(imageData.width, imageData.height));
 			depthIdxs.memset((uint8_t)NO_ID);
 		}
-		const size_t nNumPointsPrev(pointcloud.points.GetSize());
 		for (int i=0; i<sizeMap.height; ++i) {
 			for (int j=0; j<sizeMap.width; ++j) {
 				const ImageRef x(j,i);
@@ -1251,10 +1852,13 @@ void DepthMapsData::FuseDepthMaps(PointCloud& pointcloud, bool bEstimateColor, b
 				if (depth == 0)
 					continue;
 				++nDepths;
+				++stats.nDepths;
 				ASSERT(ISINSIDE(depth, depthData.dMin, depthData.dMax));
 				uint32_t& idxPoint = depthIdxs(x);
-				if (idxPoint != NO_ID)
+				if (idxPoint != NO_ID) {
+					++stats.nDepthsFused;
 					continue;
+				}
 				// create the corresponding 3D point
 				idxPoint = (uint32_t)pointcloud.points.GetSize();
 				PointCloud::Point& point = pointcloud.points.AddEmpty();
@@ -1279,12 +1883,16 @@ void DepthMapsData::FuseDepthMaps(PointCloud& pointcloud, bool bEstimateColor, b
 						continue;
 					const Image& imageDataB = scene.images[idxImageB];
 					const Point3f pt(imageDataB.camera.ProjectPointP3(point));
-					if (pt.z <= 0)
+					if (pt.z <= 0) {
+						++stats.nOutside;
 						continue;
+					}
 					const ImageRef xB(ROUND2INT(pt.x/pt.z), ROUND2INT(pt.y/pt.z));
 					DepthMap& depthMapB = depthDataB.depthMap;
-					if (!depthMapB.isInside(xB))
+					if (!depthMapB.isInside(xB)) {
+						++stats.nOutside;
 						continue;
+					}
 					Depth& depthB = depthMapB(xB);
 					if (depthB == 0)
 						continue;
@@ -1309,8 +1917,12 @@ void DepthMapsData::FuseDepthMaps(PointCloud& pointcloud, bool bEstimateColor, b
 							if (bEstimateNormal)
 								N += normalB*confidenceB;
 							confidence += confidenceB;
+							++stats.neighborMatches[(IIndex)(pNeighbor-depthData.neighbors.Begin())];
 							continue;
 						}
+						++stats.nRejectedNormal;
+					} else {
+						++stats.nRejectedDepth;
 					}
 					if (pt.z < depthB) {
 						// discard depth
@@ -1329,6 +1941,7 @@ void DepthMapsData::FuseDepthMaps(PointCloud& pointcloud, bool bEstimateColor, b
 					pointcloud.pointWeights.RemoveLast();
 					pointcloud.pointViews.RemoveLast();
 					pointcloud.points.RemoveLast();
+					++stats.nRejectedViews;
 				} else {
 					// this point is valid, store it
 					const REAL nrm(REAL(1)/confidence);
@@ -1341,11 +1954,35 @@ void DepthMapsData::FuseDepthMaps(PointCloud& pointcloud, bool bEstimateColor, b
 					// invalidate all neighbor depths that do not agree with it
 					for (Depth* pDepth: invalidDepths)
 						*pDepth = 0;
+					stats.nInvalidatedDepths += invalidDepths.GetSize();
+					if (grid.cellSize > 0) {
+						// keep a single point per grid cell;
+						// the pixels of the merged point stay marked as fused
+						const auto itCell(grid.cells.emplace(grid.GetCell(point), (PointCloud::Index)idxPoint));
+						if (itCell.second) {
+							++stats.nPoints;
+						} else {
+							++stats.nMerged;
+							MergePoints(itCell.first->second, (PointCloud::Index)idxPoint);
+							projs.RemoveLast();
+							pointcloud.pointWeights.RemoveLast();
+							pointcloud.pointViews.RemoveLast();
+							pointcloud.points.RemoveLast();
+							if (bEstimateColor)
+								pointcloud.colors.RemoveLast();
+							if (bEstimateNormal)
+								pointcloud.normals.RemoveLast();
+						}
+					} else {
+						++stats.nPoints;
+					}
 				}
 			}
 		}
+		EnforcePointsBudget();
+		stats.time = Timer::SysTime2TimeMs(Timer::GetSysTime()-timeStart);
 		ASSERT(pointcloud.points.GetSize() == pointcloud.pointViews.GetSize() && pointcloud.points.GetSize() == pointcloud.pointWeights.GetSize() && pointcloud.points.GetSize() == projs.GetSize());
-		DEBUG_ULTIMATE("Depths map for reference image %3u fused using %u depths maps: %u new points (%s)", idxImage, depthData.images.GetSize()-1, pointcloud.points.GetSize()-nNumPointsPrev, TD_TIMER_GET_FMT().c_str());
+		DEBUG_ULTIMATE("Depths map for reference image %3u fused using %u depths maps: %u new points, %u merged (%s)", idxImage, depthData.images.GetSize()-1, stats.nPoints, stats.nMerged, TD_TIMER_GET_FMT().c_str());
 		progress.display(pConnection-connections.Begin());
 	}
 	GET_LOGCONSOLE().Play();
@@ -1382,18 +2019,65 @@ void DepthMapsData::FuseDepthMaps(PointCloud& pointcloud, bool bEstimateColor, b
 	}
 
 	// release all depth-maps
-	for (DepthData& depthData: arrDepthData)
-		if (depthData.IsValid())
-			depthData.DecRef();
+	FOREACH(i, arrDepthData)
+		if (imageRoles[i] != 0)
+			arrDepthData[i].DecRef();
 } // FuseDepthMaps
 /*----------------------------------------------------------------*/
 
+// export the counters collected during the last depth-maps fusion;
+// the format is selected by the file extension: JSON if .json, CSV otherwise
+bool DepthMapsData::ExportFusionStats(const String& fileName) const
+{
+	Util::ensureFolder(fileName);
+	File f(fileName, File::WRITE, File::CREATE | File::TRUNCATE);
+	if (!f.isOpen()) {
+		VERBOSE("error: can not write fusion stats '%s'", fileName.c_str());
+		return false;
+	}
+	const bool bJSON(Util::getFileExt(fileName).ToLower() == _T(".json"));
+	if (bJSON)
+		f << "{\n\"minViewsFuse\": " << String::ToString(OPTDENSE::nMinViewsFuse)
+		  << ",\n\"depthDiffThreshold\": " << String::ToString(OPTDENSE::fDepthDiffThreshold)
+		  << ",\n\"normalDiffThreshold\": " << String::ToString(OPTDENSE::fNormalDiffThreshold)
+		  << ",\n\"images\": [";
+	else
+		f << "image,id,neighbors,depths,fused,rejected_depth,rejected_normal,rejected_views,invalidated,outside,points,merged,time_ms,neighbor_matches\n";
+	FOREACH(i, fusionStats) {
+		const FusionStats& stats = fusionStats[i];
+		String matches;
+		FOREACH(n, stats.neighborMatches) {
+			if (n)
+				matches += bJSON ? _T(",") : _T(" ");
+			matches += String::ToString(stats.neighborMatches[n]);
+		}
+		const IIndex ID(scene.images[stats.idxImage].ID);
+		if (bJSON)
+			f.print("%s\n{\"image\": %u, \"id\": %u, \"neighbors\": %u, \"depths\": %u, \"fused\": %u, "
+				"\"rejectedDepth\": %u, \"rejectedNormal\": %u, \"rejectedViews\": %u, \"invalidated\": %u, "
+				"\"outside\": %u, \"points\": %u, \"merged\": %u, \"timeMs\": %.3f, \"neighborMatches\": [%s]}",
+				i ? "," : "", stats.idxImage, ID, stats.nNeighbors, stats.nDepths, stats.nDepthsFused,
+				stats.nRejectedDepth, stats.nRejectedNormal, stats.nRejectedViews, stats.nInvalidatedDepths,
+				stats.nOutside, stats.nPoints, stats.nMerged, stats.time, matches.c_str());
+		else
+			f.print("%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%.3f,%s\n",
+				stats.idxImage, ID, stats.nNeighbors, stats.nDepths, stats.nDepthsFused,
+				stats.nRejectedDepth, stats.nRejectedNormal, stats.nRejectedViews, stats.nInvalidatedDepths,
+				stats.nOutside, stats.nPoints, stats.nMerged, stats.time, matches.c_str());
+	}
+	if (bJSON)
+		f << "\n]\n}\n";
+	DEBUG_EXTRA("Fusion stats exported for %u depth-maps: %s", fusionStats.GetSize(), fileName.c_str());
+	return true;
+} // ExportFusionStats
+/*----------------------------------------------------------------*/
+
 
 
 // S T R U C T S ///////////////////////////////////////////////////
 
-DenseDepthMapData::DenseDepthMapData(Scene& _scene, int _nFusionMode)
-	: scene(_scene), depthMaps(_scene), idxImage(0), sem(1), nEstimationGeometricIter(-1), nFusionMode(_nFusionMode)
+DenseDepthMapData::DenseDepthMapData(Scene& _scene, int _nFusionMode, bool _bReuseDepthMaps)
+	: scene(_scene), depthMaps(_scene), idxImage(0), sem(1), nEstimationGeometricIter(-1), nFusionMode(_nFusionMode), bReuseDepthMaps(_bReuseDepthMaps), bWorker(false), fLockTimeout(0), bStopHeartbeat(true)
 {
 	if (nFusionMode < 0) {
 		STEREO::SemiGlobalMatcher::CreateThreads(scene.nMaxThreads);
@@ -1413,6 +2097,177 @@ void DenseDepthMapData::SignalCompleteDepthmapFilter()
 	if (Thread::safeDec(idxImage) == 0)
 		sem.Signal((unsigned)images.GetSize()*2);
 }
+
+namespace {
+// atomically create the given file, failing if it already exists
+// (exclusive creation is atomic on local file-systems and on NFSv3+)
+bool CreateFileExclusive(const String& fileName)
+{
+	#ifdef _MSC_VER
+	const int fd(_open(fileName.c_str(), _O_CREAT|_O_EXCL|_O_WRONLY, _S_IREAD|_S_IWRITE));
+	if (fd < 0)
+		return false;
+	_close(fd);
+	#else
+	const int fd(open(fileName.c_str(), O_CREAT|O_EXCL|O_WRONLY, 0644));
+	if (fd < 0)
+		return false;
+	close(fd);
+	#endif
+	return true;
+}
+// set the modification time of the given file to the current time, creating it if needed
+// (on a network file-system the time is set by the file server)
+bool TouchFile(const String& fileName, bool bCreate=true)
+{
+	#ifdef _MSC_VER
+	if (bCreate) {
+		const int fd(_open(fileName.c_str(), _O_CREAT|_O_WRONLY, _S_IREAD|_S_IWRITE));
+		if (fd < 0)
+			return false;
+		_close(fd);
+	}
+	return _utime(fileName.c_str(), NULL) == 0;
+	#else
+	if (bCreate) {
+		const int fd(open(fileName.c_str(), O_CREAT|O_WRONLY, 0644));
+		if (fd < 0)
+			return false;
+		close(fd);
+	}
+	return utime(fileName.c_str(), NULL) == 0;
+	#endif
+}
+// check if the given file was last modified more than the given number of seconds ago;
+// the current time is read from a freshly touched file next to it, so that the clocks
+// of the machines sharing the working folder do not need to be synchronized
+bool IsFileOlder(const String& fileName, float seconds)
+{
+	struct stat info;
+	if (stat(fileName.c_str(), &info) != 0)
+		return false;
+	time_t now(time(NULL));
+	const String clockFileName(String::FormatString("%s.%u.clock", fileName.c_str(), (uint32_t)Timer::GetSysTime()));
+	if (TouchFile(clockFileName)) {
+		struct stat infoNow;
+		if (stat(clockFileName.c_str(), &infoNow) == 0)
+			now = infoNow.st_mtime;
+		File::deleteFile(clockFileName.c_str());
+	}
+	return difftime(now, info.st_mtime) > seconds;
+}
+// a depth-map is pending if it was neither saved nor marked done;
+// bAbandoned is set if its lock timed out (or it is not claimed at all)
+bool IsDepthMapPending(uint32_t ID, float fLockTimeout, bool& bAbandoned)
+{
+	if (File::access(ComposeDepthFilePath(ID, "dmap")) || File::access(ComposeDepthFilePath(ID, "done")))
+		return false;
+	const String lockFileName(ComposeDepthFilePath(ID, "lock"));
+	bAbandoned = !File::access(lockFileName) || (fLockTimeout > 0 && IsFileOlder(lockFileName, fLockTimeout));
+	return true;
+}
+
+// time the core of the patch-match score, bilinear sampling a view and accumulating
+// the NCC terms, in order to calibrate the time predictions (seconds per sample)
+double BenchmarkPatchSample()
+{
+	const int size(512);
+	FloatArr image(size*size);
+	FOREACH(i, image)
+		image[i] = (float)((i*31+(i/size)*17)%255);
+	const uint32_t nSamples(1u<<22);
+	const Timer::SysType timeStart(Timer::GetSysTime());
+	double sum(0), sumSq(0), sumProd(0);
+	float x(1.5f), y(1.5f);
+	for (uint32_t i=0; i<nSamples; ++i) {
+		const int ix((int)x), iy((int)y);
+		const float dx(x-ix), dy(y-iy);
+		const float* const p(image.data()+iy*size+ix);
+		const float v((p[0]*(1-dx)+p[1]*dx)*(1-dy)+(p[size]*(1-dx)+p[size+1]*dx)*dy);
+		sum += v;
+		sumSq += v*v;
+		sumProd += v*p[0];
+		if ((x += 1.37f) >= size-2) {
+			x -= size-3;
+			if ((y += 1.13f) >= size-2)
+				y -= size-3;
+		}
+	}
+	const double seconds(Timer::SysTime2TimeMs(Timer::GetSysTime()-timeStart)/1000.0);
+	DEBUG_ULTIMATE("Calibration checksum %g", sum+sumSq+sumProd);
+	return seconds/nSamples;
+}
+} // unnamed namespace
+
+// the depth-map task of an image is claimed by creating its lock-file, and once processed
+// (successfully or not), the lock-file is renamed to mark the task as done;
+// an abandoned lock (ex. the worker holding it crashed) is broken by renaming it to a unique name,
+// so only one worker succeeds; in the unlikely case two workers still end up estimating
+// the same depth-map, the result is the same as it is saved atomically by each of them
+bool DenseDepthMapData::ClaimDepthMap(IIndex idx)
+{
+	const uint32_t ID(scene.images[idx].ID);
+	if (File::access(ComposeDepthFilePath(ID, "done")))
+		return false;
+	const String lockFileName(ComposeDepthFilePath(ID, "lock"));
+	if (!CreateFileExclusive(lockFileName)) {
+		if (fLockTimeout <= 0 || !IsFileOlder(lockFileName, fLockTimeout))
+			return false;
+		const String abandonedFileName(String::FormatString("%s.%u", lockFileName.c_str(), (uint32_t)Timer::GetSysTime()));
+		if (rename(lockFileName.c_str(), abandonedFileName.c_str()) != 0)
+			return false;
+		File::deleteFile(abandonedFileName.c_str());
+		DEBUG_EXTRA("Depth-map %u lock abandoned by another worker: reclaimed", ID);
+		if (!CreateFileExclusive(lockFileName))
+			return false;
+	}
+	Lock l(csLocks);
+	lockedDepthMaps.emplace(ID);
+	return true;
+}
+void DenseDepthMapData::CompleteDepthMap(IIndex idx)
+{
+	const uint32_t ID(scene.images[idx].ID);
+	{
+		Lock l(csLocks);
+		lockedDepthMaps.erase(ID);
+	}
+	rename(ComposeDepthFilePath(ID, "lock").c_str(), ComposeDepthFilePath(ID, "done").c_str());
+}
+
+// while estimating, keep touching the locks of the claimed depth-maps,
+// so that the other workers do not reclaim them, however long the estimation takes
+void DenseDepthMapData::StartHeartbeat()
+{
+	if (fLockTimeout <= 0)
+		return;
+	bStopHeartbeat = false;
+	threadHeartbeat.start(HeartbeatTmp, this);
+}
+void DenseDepthMapData::StopHeartbeat()
+{
+	if (bStopHeartbeat)
+		return;
+	bStopHeartbeat = true;
+	threadHeartbeat.join();
+}
+void* STCALL DenseDepthMapData::HeartbeatTmp(void* arg)
+{
+	DenseDepthMapData& data = *((DenseDepthMapData*)arg);
+	// touch the locks several times within the timeout, checking often if stopped
+	const uint32_t nPeriodMs(MAXF((uint32_t)(data.fLockTimeout*1000/4), 1000u));
+	uint32_t nElapsedMs(0);
+	while (!data.bStopHeartbeat) {
+		Thread::sleep(100);
+		if ((nElapsedMs += 100) < nPeriodMs)
+			continue;
+		nElapsedMs = 0;
+		Lock l(data.csLocks);
+		for (uint32_t ID: data.lockedDepthMaps)
+			TouchFile(ComposeDepthFilePath(ID, "lock"), false);
+	}
+	return NULL;
+}
 /*----------------------------------------------------------------*/
 
 
@@ -1422,6 +2277,695 @@ void DenseDepthMapData::SignalCompleteDepthmapFilter()
 static void* DenseReconstructionEstimateTmp(void*);
 static void* DenseReconstructionFilterTmp(void*);
 
+// if bReuseDepthMaps, the already existing depth-maps (ex. estimated while densifying
+// another chunk of the scene) are fused as they are, without being optimized or filtered again
+bool Scene::DenseReconstruction(int nFusionMode, bool bReuseDepthMaps)
+{
+	DenseDepthMapData data(*this, nFusionMode, bReuseDepthMaps);
+
+	// estimate depth-maps
+	if (!ComputeDepthMaps(data))
+		return false;
+	if (ABS(nFusionMode) == 1)
+		return false;
+
+	// fuse all depth-maps
+	pointcloud.Release();
+	InvalidateImagePoints();
+	if (OPTDENSE::nMinViewsFuse < 2) {
+		// merge depth-maps
+		data.depthMaps.MergeDepthMaps(pointcloud, OPTDENSE::nEstimateColors == 2, OPTDENSE::nEstimateNormals == 2);
+	} else {
+		// fuse depth-maps
+		data.depthMaps.FuseDepthMaps(pointcloud, OPTDENSE::nEstimateColors == 2, OPTDENSE::nEstimateNormals == 2);
+		if (!OPTDENSE::strFusionStatsFileName.empty())
+			data.depthMaps.ExportFusionStats(OPTDENSE::strFusionStatsFileName);
+	}
+	#if TD_VERBOSE != TD_VERBOSE_OFF
+	if (g_nVerbosityLevel > 2) {
+		// print number of points with 3+ views
+		size_t nPoints1m(0), nPoints2(0), nPoints3p(0);
+		FOREACHPTR(pViews, pointcloud.pointViews) {
+			switch (pViews->GetSize())
+			{
+			case 0:
+			case 1:
+				++nPoints1m;
+				break;
+			case 2:
+				++nPoints2;
+				break;
+			default:
+				++nPoints3p;
+			}
+		}
+		VERBOSE("Dense point-cloud composed of:\n\t%u points with 1- views\n\t%u points with 2 views\n\t%u points with 3+ views", nPoints1m, nPoints2, nPoints3p);
+	}
+	#endif
+
+	if (!pointcloud.IsEmpty()) {
+		if (pointcloud.colors.IsEmpty() && OPTDENSE::nEstimateColors == 1)
+			EstimatePointColors(images, pointcloud);
+		if (pointcloud.normals.IsEmpty() && OPTDENSE::nEstimateNormals == 1)
+			EstimatePointNormals(images, pointcloud);
+	}
+	return true;
+} // DenseReconstruction
+/*----------------------------------------------------------------*/
+
+// do first half of dense reconstruction: depth map computation
+// results are saved to "data"
+bool Scene::ComputeDepthMaps(DenseDepthMapData& data)
+{
+	{
+	// maps global view indices to our list of views to be processed
+	IIndexArr imagesMap;
+
+	// prepare images for dense reconstruction (load if needed)
+	{
+		TD_TIMER_START();
+		data.images.Reserve(images.GetSize());
+		imagesMap.Resize(images.GetSize());
+		#ifdef DENSE_USE_OPENMP
+		bool bAbort(false);
+		#pragma omp parallel for shared(data, bAbort)
+		for (int_t ID=0; ID<(int_t)images.GetSize(); ++ID) {
+			#pragma omp flush (bAbort)
+			if (bAbort)
+				continue;
+			const IIndex idxImage((IIndex)ID);
+		#else
+		FOREACH(idxImage, images) {
+		#endif
+			// skip invalid, uncalibrated or discarded images
+			Image& imageData = images[idxImage];
+			if (!imageData.IsValid()) {
+				#ifdef DENSE_USE_OPENMP
+				#pragma omp critical
+				#endif
+				imagesMap[idxImage] = NO_ID;
+				continue;
+			}
+			// map image index (only the images in the range to estimate,
+			// but still load all images, as they can be neighbors of the estimated ones)
+			#ifdef DENSE_USE_OPENMP
+			#pragma omp critical
+			#endif
+			if (OPTDENSE::nImageRangeEnd > 0 && (idxImage < OPTDENSE::nImageRangeBegin || idxImage >= OPTDENSE::nImageRangeEnd)) {
+				imagesMap[idxImage] = NO_ID;
+			} else {
+				imagesMap[idxImage] = data.images.GetSize();
+				data.images.Insert(idxImage);
+			}
+			// reload image at the appropriate resolution
+			unsigned nResolutionLevel(OPTDENSE::nResolutionLevel);
+			const unsigned nMaxResolution(imageData.RecomputeMaxResolution(nResolutionLevel, OPTDENSE::nMinResolution, OPTDENSE::nMaxResolution));
+			if (!imageData.ReloadImage(nMaxResolution)) {
+				#ifdef DENSE_USE_OPENMP
+				bAbort = true;
+				#pragma omp flush (bAbort)
+				continue;
+				#else
+				return false;
+				#endif
+			}
+			imageData.UpdateCamera(platforms);
+			// print image camera
+			DEBUG_ULTIMATE("K%d = \n%s", idxImage, cvMat2String(imageData.camera.K).c_str());
+			DEBUG_LEVEL(3, "R%d = \n%s", idxImage, cvMat2String(imageData.camera.R).c_str());
+			DEBUG_LEVEL(3, "C%d = \n%s", idxImage, cvMat2String(imageData.camera.C).c_str());
+		}
+		#ifdef DENSE_USE_OPENMP
+		if (bAbort || data.images.IsEmpty()) {
+		#else
+		if (data.images.IsEmpty()) {
+		#endif
+			VERBOSE("error: preparing images for dense reconstruction failed (errors loading images)");
+			return false;
+		}
+		VERBOSE("Preparing images for dense reconstruction completed: %d images (%s)", images.GetSize(), TD_TIMER_GET_FMT().c_str());
+	}
+
+	// select images to be used for dense reconstruction
+	{
+		TD_TIMER_START();
+		// make sure the image to points index is up to date before accessing it in parallel
+		if (!IsImagePointsIndexed())
+			IndexImagePoints();
+		// for each image, find all useful neighbor views
+		IIndexArr invalidIDs;
+		#ifdef DENSE_USE_OPENMP
+		#pragma omp parallel for shared(data, invalidIDs)
+		for (int_t ID=0; ID<(int_t)data.images.GetSize(); ++ID) {
+			const IIndex idx((IIndex)ID);
+		#else
+		FOREACH(idx, data.images) {
+		#endif
+			const IIndex idxImage(data.images[idx]);
+			ASSERT(imagesMap[idxImage] != NO_ID);
+			DepthData& depthData(data.depthMaps.arrDepthData[idxImage]);
+			if (!data.depthMaps.SelectViews(depthData)) {
+				#ifdef DENSE_USE_OPENMP
+				#pragma omp critical
+				#endif
+				invalidIDs.InsertSort(idx);
+			}
+		}
+		RFOREACH(i, invalidIDs) {
+			const IIndex idx(invalidIDs[i]);
+			imagesMap[data.images.Last()] = idx;
+			imagesMap[data.images[idx]] = NO_ID;
+			data.images.RemoveAt(idx);
+		}
+		if (data.images.IsEmpty()) {
+			VERBOSE("error: no valid images to be dense reconstructed");
+			return false;
+		}
+		VERBOSE("Selecting images for dense reconstruction completed: %d images (%s)", data.images.GetSize(), TD_TIMER_GET_FMT().c_str());
+	}
+	}
+
+	// mark the depth-maps to be reused as they are
+	data.reusedDepthMaps.resize(data.images.GetSize());
+	FOREACH(i, data.images)
+		data.reusedDepthMaps[i] = data.bReuseDepthMaps && data.nFusionMode >= 0 && File::access(ComposeDepthFilePath(images[data.images[i]].ID, "dmap"));
+
+	// initialize the queue of images to be processed
+	data.idxImage = 0;
+	ASSERT(data.events.IsEmpty());
+	data.events.AddEvent(new EVTProcessImage(0));
+	// start working threads
+	data.progress = new Util::Progress("Estimated depth-maps", data.images.GetSize());
+	GET_LOGCONSOLE().Pause();
+	if (nMaxThreads > 1) {
+		// multi-thread execution
+		cList<SEACAVE::Thread> threads(2);
+		FOREACHPTR(pThread, threads)
+			pThread->start(DenseReconstructionEstimateTmp, (void*)&data);
+		FOREACHPTR(pThread, threads)
+			pThread->join();
+	} else {
+		// single-thread execution
+		DenseReconstructionEstimate((void*)&data);
+	}
+	GET_LOGCONSOLE().Play();
+	if (!data.events.IsEmpty())
+		return false;
+	data.progress.Release();
+
+	// the depth-maps of the workers or of a range of images are filtered only once all of them are estimated
+	if ((OPTDENSE::nOptimize & OPTDENSE::ADJUST_FILTER) != 0 && !data.bWorker && OPTDENSE::nImageRangeEnd == 0) {
+		// initialize the queue of depth-maps to be filtered (skip the reused ones)
+		data.sem.Clear();
+		ASSERT(data.events.IsEmpty());
+		IIndex nFilterImages(0);
+		FOREACH(i, data.images) {
+			if (data.reusedDepthMaps[i])
+				continue;
+			data.events.AddEvent(new EVTFilterDepthMap(i));
+			++nFilterImages;
+		}
+		data.idxImage = nFilterImages;
+		// start working threads
+		data.progress = new Util::Progress("Filtered depth-maps", nFilterImages);
+		GET_LOGCONSOLE().Pause();
+		if (nMaxThreads > 1) {
+			// multi-thread execution
+			cList<SEACAVE::Thread> threads(MINF(nMaxThreads, (unsigned)data.images.GetSize()));
+			FOREACHPTR(pThread, threads)
+				pThread->start(DenseReconstructionFilterTmp, (void*)&data);
+			FOREACHPTR(pThread, threads)
+				pThread->join();
+		} else {
+			// single-thread execution
+			DenseReconstructionFilter((void*)&data);
+		}
+		GET_LOGCONSOLE().Play();
+		if (!data.events.IsEmpty())
+			return false;
+		data.progress.Release();
+	}
+	return true;
+} // ComputeDepthMaps
+/*----------------------------------------------------------------*/
+
+// fuse the depth-maps of the given new images into the existing dense point-cloud
+// (ex. after a new shot was added to an already densified scene);
+// the depth-maps of the new images and of their neighbors must be already estimated,
+// and only the new depth-maps are fused against the existing points and the neighbor depth-maps
+bool Scene::DenseFuseNewImages(const IIndexArr& newImages)
+{
+	TD_TIMER_STARTD();
+	if (pointcloud.IsEmpty() || newImages.IsEmpty()) {
+		VERBOSE("error: incremental fusion needs an existing dense point-cloud and at least one new image");
+		return false;
+	}
+	DenseDepthMapData data(*this);
+	std::unordered_map<IIndex,IIndex> mapImageIDs(images.GetSize());
+	FOREACH(idxImage, images)
+		mapImageIDs.emplace(images[idxImage].ID, idxImage);
+
+	// select the neighbor views of the new images
+	if (!IsImagePointsIndexed())
+		IndexImagePoints();
+	IIndexArr imagesFuse(0, newImages.GetSize());
+	for (IIndex idxImage: newImages) {
+		if (idxImage >= images.GetSize() || !images[idxImage].IsValid()) {
+			VERBOSE("error: invalid new image %u", idxImage);
+			return false;
+		}
+		if (!File::access(ComposeDepthFilePath(images[idxImage].ID, "dmap"))) {
+			VERBOSE("error: missing depth-map for new image %u", idxImage);
+			return false;
+		}
+		DepthData& depthData(data.depthMaps.arrDepthData[idxImage]);
+		if (!images[idxImage].neighbors.IsEmpty()) {
+			// filter the known neighbor views
+			if (!data.depthMaps.SelectViews(depthData)) {
+				DEBUG_EXTRA("warning: new image %3u has no neighbor views and it is not fused", idxImage);
+				continue;
+			}
+			depthData.points.Release();
+		} else {
+			// use the views the depth-map was estimated with
+			String imageFileName;
+			IIndexArr IDs;
+			cv::Size imageSize;
+			Camera camera;
+			Depth dMin, dMax;
+			DepthMap depthMap;
+			NormalMap normalMap;
+			ConfidenceMap confMap;
+			if (!ImportDepthDataRaw(ComposeDepthFilePath(images[idxImage].ID, "dmap"),
+					imageFileName, IDs, imageSize, camera.K, camera.R, camera.C,
+					dMin, dMax, depthMap, normalMap, confMap, 0))
+				return false;
+			for (IIndex i=1; i<IDs.GetSize(); ++i) {
+				const auto itImage(mapImageIDs.find(IDs[i]));
+				if (itImage == mapImageIDs.end() || !images[itImage->second].IsValid())
+					continue;
+				ViewScore& neighbor = depthData.neighbors.AddEmpty();
+				neighbor.idx.ID = itImage->second;
+				neighbor.idx.points = 0;
+				neighbor.idx.scale = 1;
+				neighbor.idx.angle = 0;
+				neighbor.idx.area = 0;
+				neighbor.score = float(IDs.GetSize()-i);
+			}
+			if (depthData.neighbors.IsEmpty()) {
+				DEBUG_EXTRA("warning: new image %3u has no neighbor views and it is not fused", idxImage);
+				continue;
+			}
+		}
+		imagesFuse.Insert(idxImage);
+	}
+
+	// reload the new images and their neighbors at the depth-map resolution
+	BoolArr imagesLoad(images.GetSize());
+	imagesLoad.Memset(0);
+	for (IIndex idxImage: imagesFuse) {
+		imagesLoad[idxImage] = true;
+		for (const ViewScore& neighbor: data.depthMaps.arrDepthData[idxImage].neighbors)
+			imagesLoad[neighbor.idx.ID] = true;
+	}
+	FOREACH(idxImage, images) {
+		if (!imagesLoad[idxImage])
+			continue;
+		Image& imageData = images[idxImage];
+		unsigned nResolutionLevel(OPTDENSE::nResolutionLevel);
+		const unsigned nMaxResolution(imageData.RecomputeMaxResolution(nResolutionLevel, OPTDENSE::nMinResolution, OPTDENSE::nMaxResolution));
+		if (!imageData.ReloadImage(nMaxResolution, OPTDENSE::nEstimateColors == 2))
+			return false;
+		imageData.UpdateCamera(platforms);
+	}
+	for (IIndex idxImage: imagesFuse) {
+		// only the reference view is needed by the fusion
+		DepthData::ViewData& viewRef = data.depthMaps.arrDepthData[idxImage].images.AddEmpty();
+		viewRef.scale = 1;
+		viewRef.pImageData = &images[idxImage];
+		viewRef.camera = viewRef.pImageData->camera;
+	}
+
+	// fuse the new depth-maps with the existing point-cloud
+	const PointCloud::Index nPointsPrev((PointCloud::Index)pointcloud.GetSize());
+	data.depthMaps.FuseDepthMaps(pointcloud, OPTDENSE::nEstimateColors == 2, OPTDENSE::nEstimateNormals == 2, &imagesFuse);
+	InvalidateImagePoints();
+	if (!OPTDENSE::strFusionStatsFileName.empty())
+		data.depthMaps.ExportFusionStats(OPTDENSE::strFusionStatsFileName);
+	DEBUG_EXTRA("Incremental fusion of %u new images: %u points -> %u points (%s)", imagesFuse.GetSize(), nPointsPrev, pointcloud.GetSize(), TD_TIMER_GET_FMT().c_str());
+	return true;
+} // DenseFuseNewImages
+/*----------------------------------------------------------------*/
+
+// densify the scene chunk by chunk (as obtained by Split()) and merge the fused point-clouds:
+//  - first the depth-maps are estimated chunk after chunk, each chunk using all threads;
+//    the depth-maps of the images shared with the previous chunks are reused, so each one is estimated only once
+//  - next the chunks are fused concurrently, as many at a time as fit in the given memory budget
+//    (bytes, 0 - one chunk at a time), sharing the available threads
+//  - finally the points of each chunk inside its bounding-box are gathered in this scene's point-cloud
+bool Scene::DenseReconstructionChunks(const ImagesChunkArr& chunks, size_t nMaxMemory)
+{
+	TD_TIMER_STARTD();
+	if (chunks.IsEmpty())
+		return false;
+	// extract the chunk scenes, keeping the image IDs of this scene, so the depth-maps are shared between chunks
+	struct Chunk {
+		Scene scene;
+		IIndexArr mapImages; // scene image index to chunk image index
+		IIndexArr images; // chunk image index to scene image index
+		size_t memory; // predicted memory needed to fuse this chunk (bytes)
+		bool bDone;
+	};
+	cList<Chunk> chunkScenes(chunks.size());
+	{
+		CLISTDEF2(IIndexArr) chunksMapImages(chunks.size());
+		FOREACH(c, chunks) {
+			Chunk& chunk = chunkScenes[c];
+			ExtractChunkImages(chunks[c], chunk.scene, chunksMapImages[c]);
+		}
+		CLISTDEF2(PointCloud::IndexArr) chunksPoints;
+		IndexChunksPoints(chunksMapImages, chunksPoints);
+		FOREACH(c, chunks) {
+			Chunk& chunk = chunkScenes[c];
+			ExtractChunkPoints(chunksMapImages[c], chunksPoints[c], chunk.scene);
+			chunksPoints[c].Release();
+			chunk.mapImages.Swap(chunksMapImages[c]);
+		}
+	}
+	size_t nTotalMemory(0);
+	FOREACH(c, chunks) {
+		Chunk& chunk = chunkScenes[c];
+		chunk.images.resize(chunk.scene.images.size());
+		chunk.memory = 0;
+		chunk.bDone = false;
+		FOREACH(idxImage, images) {
+			const IIndex idxImageChunk(chunk.mapImages[idxImage]);
+			if (idxImageChunk == NO_ID)
+				continue;
+			chunk.images[idxImageChunk] = idxImage;
+			Image& imageData = chunk.scene.images[idxImageChunk];
+			imageData.ID = images[idxImage].ID;
+			chunk.memory += EstimateImageMemory(imageData);
+		}
+		nTotalMemory += chunk.memory;
+	}
+	const IIndex nChunks(chunkScenes.size());
+
+	// estimate the depth-maps of each chunk
+	for (IIndex c=0; c<nChunks; ++c) {
+		Chunk& chunk = chunkScenes[c];
+		VERBOSE("Estimating depth-maps of chunk %u/%u: %u images", c+1, nChunks, chunk.scene.images.size());
+		chunk.scene.nMaxThreads = nMaxThreads;
+		{
+			// only estimate the depth-maps (DenseReconstruction() always returns false in this mode)
+			DenseDepthMapData data(chunk.scene, 1, true);
+			if (!chunk.scene.ComputeDepthMaps(data))
+				VERBOSE("warning: the depth-maps of chunk %u could not be estimated", c);
+		}
+		// drop the images without a depth-map, so that the fusion below never estimates
+		// (the same image can be part of several chunks fused concurrently)
+		unsigned nFailedImages(0);
+		for (Image& imageData: chunk.scene.images) {
+			// keep only the images data needed later for fusion
+			imageData.ReleaseImage();
+			if (imageData.IsValid() && !File::access(ComposeDepthFilePath(imageData.ID, "dmap"))) {
+				imageData.poseID = NO_ID;
+				++nFailedImages;
+			}
+		}
+		if (nFailedImages)
+			VERBOSE("warning: %u images of chunk %u have no depth-map and are not fused", nFailedImages, c);
+	}
+
+	// fuse the chunks concurrently, as many as fit in the memory budget
+	const unsigned nWorkers(nMaxMemory == 0 ? 1u :
+		MINF(MINF((unsigned)nChunks, nMaxThreads), MAXF((unsigned)(nMaxMemory*nChunks/MAXF(nTotalMemory, size_t(1))), 1u)));
+	const unsigned nThreadsChunk(MAXF(nMaxThreads/nWorkers, 1u));
+	const String strFusionStatsFileName(OPTDENSE::strFusionStatsFileName);
+	if (!strFusionStatsFileName.empty()) {
+		VERBOSE("warning: fusion statistics are not exported when densifying sub-scenes");
+		OPTDENSE::strFusionStatsFileName.clear(); // not supported by the concurrent fusions
+	}
+	pointcloud.Release();
+	InvalidateImagePoints();
+	struct FuseChunks {
+		Scene& scene;
+		cList<Chunk>& chunks;
+		const ImagesChunkArr& chunksAABB;
+		const size_t nMaxMemory;
+		const unsigned nThreadsChunk;
+		CriticalSection cs;
+		Semaphore sem; // signaled each time a fused chunk releases its memory
+		size_t nUsedMemory;
+		unsigned nWaiting; // number of workers waiting for memory to be released
+		IIndex nChunksFused;
+		bool bFailed;
+		// claim the next chunk that fits in the memory budget, waiting for memory to be released as needed
+		IIndex Claim() {
+			while (true) {
+				{
+					Lock l(cs);
+					bool bWaitMemory(false); // a chunk is left, but does not fit in the memory budget yet
+					FOREACH(c, chunks) {
+						Chunk& chunk = chunks[c];
+						if (chunk.bDone)
+							continue;
+						if (nUsedMemory == 0 || nMaxMemory == 0 || nUsedMemory+chunk.memory <= nMaxMemory) {
+							chunk.bDone = true;
+							nUsedMemory += chunk.memory;
+							return c;
+						}
+						bWaitMemory = true;
+					}
+					if (!bWaitMemory)
+						return NO_ID;
+					++nWaiting;
+				}
+				sem.Wait();
+			}
+		}
+		void Fuse(IIndex c) {
+			Chunk& chunk = chunks[c];
+			chunk.scene.nMaxThreads = nThreadsChunk;
+			#ifdef DENSE_USE_OPENMP
+			// the parallel loops of this worker thread share the cores with the other workers
+			omp_set_num_threads((int)nThreadsChunk);
+			#endif
+			const bool bFused(chunk.scene.DenseReconstruction(0, true));
+			// keep only the points inside the chunk region, so the overlapping chunks do not duplicate them
+			PointCloud& pc = chunk.scene.pointcloud;
+			if (bFused)
+				pc.RemovePointsOutside(OBB3f(OBB3f::MATRIX::Identity(), chunksAABB[c].aabb.ptMin, chunksAABB[c].aabb.ptMax));
+			Lock l(cs);
+			if (!bFused) {
+				bFailed = true;
+			} else {
+				// append the points to the scene point-cloud, mapping the views to the scene images
+				scene.AppendChunkPoints(pc, chunk.images);
+			}
+			VERBOSE("Chunk %u fused: %u points (%u/%u chunks)", c, pc.GetSize(), nChunksFused+1, chunks.size());
+			chunk.scene.Release();
+			nUsedMemory -= chunk.memory;
+			++nChunksFused;
+			// wake up the workers waiting for memory to re-check the remaining chunks
+			if (nWaiting) {
+				sem.Signal(nWaiting);
+				nWaiting = 0;
+			}
+		}
+		static void* STCALL Process(void* arg) {
+			FuseChunks& fuse = *((FuseChunks*)arg);
+			IIndex c;
+			while ((c=fuse.Claim()) != NO_ID)
+				fuse.Fuse(c);
+			return NULL;
+		}
+	} fuse{*this, chunkScenes, chunks, nMaxMemory, nThreadsChunk};
+	VERBOSE("Fusing %u chunks, %u at a time using %u threads each (predicted memory %s per chunk on average)",
+		nChunks, nWorkers, nThreadsChunk, Util::formatBytes(nTotalMemory/nChunks).c_str());
+	fuse.nUsedMemory = 0;
+	fuse.nWaiting = 0;
+	fuse.nChunksFused = 0;
+	fuse.bFailed = false;
+	#ifdef DENSE_USE_OPENMP
+	const int nThreadsOMP(omp_get_max_threads());
+	#endif
+	if (nWorkers > 1) {
+		cList<SEACAVE::Thread> threads(nWorkers-1); // current thread is also used
+		FOREACHPTR(pThread, threads)
+			pThread->start(FuseChunks::Process, (void*)&fuse);
+		FuseChunks::Process((void*)&fuse);
+		FOREACHPTR(pThread, threads)
+			pThread->join();
+	} else {
+		FuseChunks::Process((void*)&fuse);
+	}
+	#ifdef DENSE_USE_OPENMP
+	omp_set_num_threads(nThreadsOMP);
+	#endif
+	OPTDENSE::strFusionStatsFileName = strFusionStatsFileName;
+	if (fuse.bFailed)
+		VERBOSE("warning: some chunks could not be fused");
+	DEBUG_EXTRA("Chunks densified: %u chunks, %u points (%s)", nChunks, pointcloud.GetSize(), TD_TIMER_GET_FMT().c_str());
+	return !pointcloud.IsEmpty();
+} // DenseReconstructionChunks
+/*----------------------------------------------------------------*/
+
+// cooperate with other processes (local or on other machines sharing the working folder)
+// in estimating the depth-maps: each worker claims the depth-maps not estimated yet through
+// lock-files, with no other coordination needed;
+// if bFuse, wait for all depth-maps to be estimated (taking over the abandoned ones),
+// and let the first worker to claim it filter and fuse them into the point-cloud;
+// the fusion is marked done in the working folder, so later workers do not fuse again;
+// returns 1 for the worker that fused the point-cloud, 0 for the others, and -1 on error
+int Scene::DenseReconstructionWorker(bool bFuse, float fLockTimeout)
+{
+	const String fuseLockFileName(MAKE_PATH("fuse.lock"));
+	const String fuseDoneFileName(MAKE_PATH("fuse.done"));
+	if (bFuse && File::access(fuseDoneFileName)) {
+		VERBOSE("Depth-maps already fused by another worker");
+		return 0;
+	}
+	while (true) {
+		// estimate the depth-maps not claimed yet by other workers
+		IIndexArr tasks;
+		{
+			DenseDepthMapData data(*this, 1);
+			data.bWorker = true;
+			data.fLockTimeout = fLockTimeout;
+			data.StartHeartbeat();
+			const bool bEstimated(ComputeDepthMaps(data));
+			data.StopHeartbeat();
+			if (!bEstimated)
+				return -1;
+			tasks.Swap(data.images);
+		}
+		if (!bFuse)
+			return 0;
+		// wait for the other workers to complete their depth-maps
+		IIndex nPending;
+		bool bAbandoned(false);
+		while (true) {
+			nPending = 0;
+			for (IIndex idxImage: tasks) {
+				bool bAbandonedImage(false);
+				if (IsDepthMapPending(images[idxImage].ID, fLockTimeout, bAbandonedImage)) {
+					++nPending;
+					bAbandoned |= bAbandonedImage;
+				}
+			}
+			if (nPending == 0 || bAbandoned)
+				break;
+			VERBOSE("Waiting for %u depth-maps estimated by other workers", nPending);
+			Thread::sleep(10000);
+		}
+		if (nPending == 0)
+			break;
+		// take over the abandoned depth-maps
+		VERBOSE("Reclaiming the abandoned depth-maps");
+	}
+	// only one worker fuses the depth-maps
+	if (File::access(fuseDoneFileName) || !CreateFileExclusive(fuseLockFileName)) {
+		VERBOSE("Depth-maps fused by another worker");
+		return 0;
+	}
+	FOREACH(idxImage, images)
+		if (images[idxImage].IsValid())
+			File::deleteFile(ComposeDepthFilePath(images[idxImage].ID, "done").c_str());
+	if (!DenseReconstruction(0)) {
+		// release the lock, so another worker can try again
+		File::deleteFile(fuseLockFileName.c_str());
+		return -1;
+	}
+	// keep the lock as a persistent marker of the completed fusion
+	if (rename(fuseLockFileName.c_str(), fuseDoneFileName.c_str()) != 0)
+		VERBOSE("warning: can not mark the fusion as done in '%s'", fuseDoneFileName.c_str());
+	return 1;
+} // DenseReconstructionWorker
+/*----------------------------------------------------------------*/
+
+// predict the resources needed to densify the scene with the current options, without estimating anything:
+// from the working resolution and number of views of each image, estimate the peak memory of
+// each stage and the disk needed, using the same cost model as the memory budget of the sub-scenes
+// (see DenseCost), and the time, calibrated by a micro-benchmark
+void Scene::PlanDenseReconstruction() const
+{
+	TD_TIMER_STARTD();
+	const double bytesDepthMap(DenseCost::bytesDepthMap);
+	// samples per pixel of a patch-match iteration for each view:
+	// about 8 hypotheses (propagations and refinements) scored on the sampled patch
+	const unsigned nPatchSize((2*OPTDENSE::nSizeHalfWindow+OPTDENSE::nSizeStep)/OPTDENSE::nSizeStep);
+	const double samplesPerPixelView(8.0*SQUARE(nPatchSize));
+	IIndex nImages(0);
+	unsigned maxWidth(0), maxHeight(0);
+	double sumPixels(0), sumViews(0), sumImages(0), sumFuse(0), maxEstimate(0), sumSamplesEstimate(0), sumSamplesFilter(0);
+	FOREACH(idxImage, images) {
+		const Image& imageData = images[idxImage];
+		if (!imageData.IsValid())
+			continue;
+		const cv::Size size(EstimateImageResolution(imageData));
+		const unsigned width((unsigned)size.width), height((unsigned)size.height);
+		const double nPixels((double)width*height);
+		// the neighbor views, if not selected yet assume the maximum number
+		unsigned numViews(imageData.neighbors.size());
+		if (numViews == 0)
+			numViews = OPTDENSE::nMaxViews;
+		if (OPTDENSE::nNumViews > 0)
+			numViews = MINF(numViews, OPTDENSE::nNumViews);
+		DEBUG_EXTRA("\timage %4u: %ux%u, %u views", idxImage, width, height, numViews);
+		if (maxWidth*maxHeight < width*height) {
+			maxWidth = width;
+			maxHeight = height;
+		}
+		++nImages;
+		sumPixels += nPixels;
+		sumViews += numViews;
+		sumImages += nPixels*DenseCost::bytesImage;
+		sumFuse += EstimateImageMemory(imageData);
+		// depth-map in estimation and the gray images of the reference and target views
+		maxEstimate = MAXF(maxEstimate, nPixels*(bytesDepthMap+sizeof(float)*(numViews+1)));
+		sumSamplesEstimate += nPixels*OPTDENSE::nEstimationIters*numViews*samplesPerPixelView;
+		sumSamplesFilter += nPixels*MINF(numViews, 8u)*2;
+	}
+	if (nImages == 0) {
+		VERBOSE("error: no valid images to plan the dense reconstruction");
+		return;
+	}
+	const double nPoints(sumPixels*DenseCost::pointsPerPixel);
+	const unsigned nThreads(MAXF(nMaxThreads, 1u));
+	// the images stay loaded at the working resolution during all stages;
+	// while estimating, the next image is initialized during the current estimation;
+	// while filtering, each thread loads a depth-map and up to 8 neighbors,
+	// plus the z-buffers of the threads splatting the neighbors of the same depth-map (at most all threads);
+	// while fusing, all depth-maps are loaded together with the fused points (as predicted by EstimateImageMemory())
+	const size_t memEstimate((size_t)(sumImages+2*maxEstimate));
+	const size_t memFilter((size_t)(sumImages+MINF((double)nImages, 9.0*nThreads)*maxWidth*maxHeight*bytesDepthMap)+
+		DepthMapsData::FilterSplatMemory(nThreads, cv::Size(maxWidth, maxHeight)));
+	const size_t memFuse((size_t)sumFuse);
+	// the depth-maps, the filtered depth and confidence maps, and the point-cloud (position, normal, color)
+	const size_t diskEstimate((size_t)(sumPixels*bytesDepthMap));
+	const size_t diskFilter((size_t)(sumPixels*(sizeof(Depth)+sizeof(float))));
+	const size_t diskFuse((size_t)(nPoints*(sizeof(PointCloud::Point)+sizeof(PointCloud::Normal)+sizeof(PointCloud::Color))));
+	// the filter and the fusion project each pixel in the neighbor views, few samples each
+	const double secondsPerSample(BenchmarkPatchSample());
+	const double hoursEstimate(sumSamplesEstimate*secondsPerSample/nThreads/3600);
+	const double hoursFilter(sumSamplesFilter*secondsPerSample/nThreads/3600);
+	const double hoursFuse(sumPixels*(sumViews/nImages)*secondsPerSample/3600);
+	VERBOSE("Dense reconstruction plan: %u images, %.1f views per image, max resolution %ux%u, %.1f MPixels in total, %u threads (%.2f ns per sample)\n"
+		"\tstage        peak RAM     disk         time\n"
+		"\testimation   %-12s %-12s %.2f h\n"
+		"\tfiltering    %-12s %-12s %.2f h\n"
+		"\tfusion       %-12s %-12s %.2f h\n"
+		"\ttotal        %-12s %-12s %.2f h (%s)",
+		nImages, sumViews/nImages, maxWidth, maxHeight, sumPixels/(1024*1024), nThreads, secondsPerSample*1e9,
+		Util::formatBytes(memEstimate).c_str(), Util::formatBytes(diskEstimate).c_str(), hoursEstimate,
+		Util::formatBytes(memFilter).c_str(), Util::formatBytes(diskEstimate+diskFilter).c_str(), hoursFilter,
+		Util::formatBytes(memFuse).c_str(), Util::formatBytes(diskEstimate+diskFuse).c_str(), hoursFuse,
+		Util::formatBytes(MAXF(memEstimate, MAXF(memFilter, memFuse))).c_str(), Util::formatBytes(diskEstimate+diskFilter+diskFuse).c_str(), hoursEstimate+hoursFilter+hoursFuse,
+		TD_TIMER_GET_FMT().c_str());
+} // PlanDenseReconstruction
+/*----------------------------------------------------------------*/
+
 /*----------------------------------------------------------------*/
 
 void* DenseReconstructionEstimateTmp(void* arg) {
@@ -1450,16 +2994,23 @@ void Scene::DenseReconstructionEstimate(void* pData)
 			const IIndex idx = data.images[evtImage.idxImage];
 			DepthData& depthData(data.depthMaps.arrDepthData[idx]);
 			const bool depthmapComputed(data.nFusionMode >= 0 && data.nEstimationGeometricIter < 0 && File::access(ComposeDepthFilePath(data.scene.images[idx].ID, "dmap")));
+			if (data.bWorker && (depthmapComputed || !data.ClaimDepthMap(idx))) {
+				// already estimated or claimed by another worker, process next image
+				data.events.AddEvent(new EVTProcessImage((IIndex)Thread::safeInc(data.idxImage)));
+				break;
+			}
 			// initialize images pair: reference image and the best neighbor view
 			ASSERT(data.neighborsMap.IsEmpty() || data.neighborsMap[evtImage.idxImage] != NO_ID);
 			if (!data.depthMaps.InitViews(depthData, data.neighborsMap.IsEmpty()?NO_ID:data.neighborsMap[evtImage.idxImage], OPTDENSE::nNumViews, !depthmapComputed, depthmapComputed ? -1 : (data.nEstimationGeometricIter >= 0 ? 1 : 0))) {
+				if (data.bWorker)
+					data.CompleteDepthMap(idx);
 				// process next image
 				data.events.AddEvent(new EVTProcessImage((IIndex)Thread::safeInc(data.idxImage)));
 				break;
 			}
 			// try to load already compute depth-map for this image
 			if (depthmapComputed) {
-				if (OPTDENSE::nOptimize & OPTDENSE::OPTIMIZE) {
+				if ((OPTDENSE::nOptimize & OPTDENSE::OPTIMIZE) && !data.reusedDepthMaps[evtImage.idxImage]) {
 					if (!depthData.Load(ComposeDepthFilePath(depthData.GetView().GetID(), "dmap"))) {
 						VERBOSE("error: invalid depth-map '%s'", ComposeDepthFilePath(depthData.GetView().GetID(), "dmap").c_str());
 						exit(EXIT_FAILURE);
@@ -1481,9 +3032,13 @@ void Scene::DenseReconstructionEstimate(void* pData)
 			data.events.AddEvent(new EVTProcessImage((uint32_t)Thread::safeInc(data.idxImage)));
 			// extract depth map
 			data.sem.Wait();
+			Thread::safeInc(data.depthMaps.nEstimationJobs);
 			if (data.nFusionMode >= 0) {
 				// extract depth-map using Patch-Match algorithm
+				const Timer::SysType timeStart(Timer::GetSysTime());
 				data.depthMaps.EstimateDepthMap(data.images[evtImage.idxImage], data.nEstimationGeometricIter);
+				if (data.nEstimationGeometricIter < 0 && (OPTDENSE::fViewMinGain > 0 || OPTDENSE::fViewTimeBudget > 0))
+					data.depthMaps.UpdateViewCost(data.images[evtImage.idxImage], (float)Timer::SysTime2TimeMs(Timer::GetSysTime()-timeStart)/1000.f);
 			} else {
 				// extract disparity-maps using SGM algorithm
 				if (data.nFusionMode == -1) {
@@ -1498,6 +3053,7 @@ void Scene::DenseReconstructionEstimate(void* pData)
 					depthData.dMin = ZEROTOLERANCE<float>(); depthData.dMax = FLT_MAX;
 				}
 			}
+			Thread::safeDec(data.depthMaps.nEstimationJobs);
 			data.sem.Signal();
 			if (OPTDENSE::nOptimize & OPTDENSE::OPTIMIZE) {
 				// optimize depth-map
@@ -1551,6 +3107,16 @@ void Scene::DenseReconstructionEstimate(void* pData)
 			}
 			#endif
 			// save compute depth-map for this image
+			if (data.bWorker) {
+				// write it under a temporary name first, so other processes never read a partial depth-map
+				if (!depthData.depthMap.empty()) {
+					const String fileName(ComposeDepthFilePath(depthData.GetView().GetID(), "dmap"));
+					const String tmpFileName(ComposeDepthFilePath(depthData.GetView().GetID(), "tmp.dmap"));
+					if (depthData.Save(tmpFileName))
+						rename(tmpFileName.c_str(), fileName.c_str());
+				}
+				data.CompleteDepthMap(idx);
+			} else
 			if (!depthData.depthMap.empty())
 				depthData.Save(ComposeDepthFilePath(depthData.GetView().GetID(), data.nEstimationGeometricIter < 0 ? "dmap" : "geo.dmap"));
 			depthData.ReleaseImages();
@@ -1684,19 +3250,9 @@ void Scene::PointCloudFilter(int thRemove)
 		PointCloud::Index idxPoint;
 		Real distance;
 		int weight;
-		#ifdef DENSE_USE_OPENMP
-		uint8_t pcs[sizeof(CriticalSection)];
-		#endif
 
 		Collector(const Cone::RAY& ray, Real angle, const PointCloud& _pointcloud, IntArr& _visibility)
-			: cone(ray, angle), coneIntersect(cone), pointcloud(_pointcloud), visibility(_visibility)
-		#ifdef DENSE_USE_OPENMP
-		{ new(pcs) CriticalSection; }
-		~Collector() { reinterpret_cast<CriticalSection*>(pcs)->~CriticalSection(); }
-		inline CriticalSection& GetCS() { return *reinterpret_cast<CriticalSection*>(pcs); }
-		#else
-		{}
-		#endif
+			: cone(ray, angle), coneIntersect(cone), pointcloud(_pointcloud), visibility(_visibility) {}
 		inline void Init(PointCloud::Index _idxPoint, const PointCloud::Point& X, int _weight) {
 			const Real thMaxDepth(1.02f);
 			idxPoint =_idxPoint;
@@ -1715,47 +3271,167 @@ void Scene::PointCloudFilter(int thRemove)
 			FOREACHRAWPTR(pIdx, idices, size) {
 				const PointCloud::Index idx(*pIdx);
 				if (coneIntersect.Classify(pointcloud.points[idx], dist) == VISIBLE && !IsDepthSimilar(distance, dist, thSimilar)) {
-					if (dist > distance)
-						visibility[idx] += pointcloud.pointViews[idx].size();
-					else
-						visibility[idx] -= weight;
+					// the same point can be updated by collectors of other threads
+					const int delta(dist > distance ? (int)pointcloud.pointViews[idx].size() : -weight);
+					#ifdef DENSE_USE_OPENMP
+					#pragma omp atomic
+					#endif
+					visibility[idx] += delta;
 				}
 			}
 		}
 	};
-	typedef CLISTDEF2(Collector) Collectors;
+	// collect all points inside the cone bounding the cones of a batch of points
+	struct BatchCollector {
+		typedef Collector::IDX IDX;
+		const Collector::ConeIntersect coneIntersect;
+		PointCloud::IndexArr& candidates;
+		BatchCollector(const Collector::Cone& cone, PointCloud::IndexArr& _candidates)
+			: coneIntersect(cone), candidates(_candidates) {}
+		inline bool Intersects(const Octree::POINT_TYPE& center, Octree::Type radius) const {
+			return coneIntersect(Collector::Sphere(center, radius*Collector::Real(SQRT_3)));
+		}
+		inline void operator () (const IDX* idices, IDX size) {
+			FOREACHRAWPTR(pIdx, idices, size)
+				candidates.Insert(*pIdx);
+		}
+	};
+	// a block of points seen by the same camera, checked by a single thread
+	struct Task {
+		PointCloud::View idxView;
+		uint32_t idxBegin, idxEnd; // range in the list of points seen by the camera
+	};
+	typedef CLISTDEF0(Task) TaskArr;
 
 	// create octree to speed-up search
 	Octree octree(pointcloud.points, [](Octree::IDX_TYPE size, Octree::Type /*radius*/) {
 		return size > 128;
 	});
 	IntArr visibility(pointcloud.GetSize()); visibility.Memset(0);
-	Collectors collectors; collectors.reserve(images.size());
+
+	// sort the points in Morton order, such that consecutive points seen by a camera
+	// are close in space and can be checked in batches
+	PointCloud::IndexArr order(pointcloud.GetSize());
+	{
+		Point3f ptMin(FLT_MAX, FLT_MAX, FLT_MAX), ptMax(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+		for (const PointCloud::Point& X: pointcloud.points) {
+			ptMin.x = MINF(ptMin.x, X.x); ptMax.x = MAXF(ptMax.x, X.x);
+			ptMin.y = MINF(ptMin.y, X.y); ptMax.y = MAXF(ptMax.y, X.y);
+			ptMin.z = MINF(ptMin.z, X.z); ptMax.z = MAXF(ptMax.z, X.z);
+		}
+		const float scale(1023.f/MAXF(MAXF(ptMax.x-ptMin.x, ptMax.y-ptMin.y), MAXF(ptMax.z-ptMin.z, FLT_EPSILON)));
+		// interleave the 10 bits of each coordinate
+		const auto SpreadBits = [](uint32_t x) -> uint32_t {
+			x = (x | (x << 16)) & 0x030000FF;
+			x = (x | (x <<  8)) & 0x0300F00F;
+			x = (x | (x <<  4)) & 0x030C30C3;
+			x = (x | (x <<  2)) & 0x09249249;
+			return x;
+		};
+		UnsignedArr codes(pointcloud.GetSize());
+		#ifdef DENSE_USE_OPENMP
+		#pragma omp parallel for
+		for (int64_t i=0; i<(int64_t)pointcloud.GetSize(); ++i) {
+			const PointCloud::Index idxPoint((PointCloud::Index)i);
+		#else
+		FOREACH(idxPoint, pointcloud.points) {
+		#endif
+			const PointCloud::Point& X = pointcloud.points[idxPoint];
+			codes[idxPoint] =
+				SpreadBits((uint32_t)((X.x-ptMin.x)*scale)) |
+				(SpreadBits((uint32_t)((X.y-ptMin.y)*scale)) << 1) |
+				(SpreadBits((uint32_t)((X.z-ptMin.z)*scale)) << 2);
+			order[idxPoint] = idxPoint;
+		}
+		std::sort(order.Begin(), order.End(), [&codes](PointCloud::Index i, PointCloud::Index j) {
+			return codes[i] < codes[j];
+		});
+	}
+
+	// group the points by the cameras seeing them,
+	// such that each thread checks a block of points seen by the same camera
+	// using its own collector, without locking
+	UnsignedArr viewOffsets(images.size()+1);
+	viewOffsets.Memset(0);
+	for (const PointCloud::ViewArr& views: pointcloud.pointViews)
+		for (PointCloud::View idxView: views)
+			++viewOffsets[idxView+1];
+	FOREACH(idxView, images)
+		viewOffsets[idxView+1] += viewOffsets[idxView];
+	PointCloud::IndexArr viewPoints(viewOffsets.Last());
+	{
+		UnsignedArr viewCounts(images.size());
+		viewCounts.Memset(0);
+		for (PointCloud::Index idxPoint: order)
+			for (PointCloud::View idxView: pointcloud.pointViews[idxPoint])
+				viewPoints[viewOffsets[idxView]+(viewCounts[idxView]++)] = idxPoint;
+	}
+	const uint32_t nPointsTask(4*1024);
+	const uint32_t nPointsBatch(16);
+	const float maxBatchSpread(8); // max angular spread of a batch, relative to the cone angle of a point
+	TaskArr tasks(0, images.size());
 	FOREACH(idxView, images) {
-		const Image& image = images[idxView];
-		const Ray3f ray(Cast<float>(image.camera.C), Cast<float>(image.camera.Direction()));
-		const float angle(float(image.ComputeFOV(0)/image.width));
-		collectors.emplace_back(ray, angle, pointcloud, visibility);
+		for (uint32_t idxBegin=viewOffsets[idxView]; idxBegin<viewOffsets[idxView+1]; idxBegin+=nPointsTask) {
+			Task& task = tasks.AddEmpty();
+			task.idxView = idxView;
+			task.idxBegin = idxBegin;
+			task.idxEnd = MINF(idxBegin+nPointsTask, viewOffsets[idxView+1]);
+		}
 	}
 
 	// run all camera-point visibility intersections
-	Util::Progress progress(_T("Point visibility checks"), pointcloud.GetSize());
+	Util::Progress progress(_T("Point visibility checks"), tasks.GetSize());
 	#ifdef DENSE_USE_OPENMP
-	#pragma omp parallel for //schedule(dynamic)
-	for (int64_t i=0; i<(int64_t)pointcloud.GetSize(); ++i) {
-		const PointCloud::Index idxPoint((PointCloud::Index)i);
+	#pragma omp parallel for schedule(dynamic)
+	for (int64_t i=0; i<(int64_t)tasks.GetSize(); ++i) {
+		const Task& task = tasks[(IDX)i];
 	#else
-	FOREACH(idxPoint, pointcloud.points) {
+	FOREACHPTR(pTask, tasks) {
+		const Task& task = *pTask;
 	#endif
-		const PointCloud::Point& X = pointcloud.points[idxPoint];
-		const PointCloud::ViewArr& views = pointcloud.pointViews[idxPoint];
-		for (PointCloud::View idxView: views) {
-			Collector& collector = collectors[idxView];
-			#ifdef DENSE_USE_OPENMP
-			Lock l(collector.GetCS());
-			#endif
-			collector.Init(idxPoint, X, (int)views.size());
-			octree.Collect(collector, collector);
+		const Image& image = images[task.idxView];
+		const Ray3f ray(Cast<float>(image.camera.C), Cast<float>(image.camera.Direction()));
+		const float angle(float(image.ComputeFOV(0)/image.width));
+		Collector collector(ray, angle, pointcloud, visibility);
+		PointCloud::IndexArr candidates;
+		for (uint32_t idxBatch=task.idxBegin; idxBatch<task.idxEnd; idxBatch+=nPointsBatch) {
+			const uint32_t idxBatchEnd(MINF(idxBatch+nPointsBatch, task.idxEnd));
+			// compute the cone bounding the cones of all points in the batch:
+			// same apex, the axis the mean direction, enlarged by the largest deviation from it
+			PointCloud::Point::EVec axis(PointCloud::Point::EVec::Zero());
+			Collector::Real maxHeight(0);
+			for (uint32_t idx=idxBatch; idx<idxBatchEnd; ++idx) {
+				const PointCloud::Index idxPoint(viewPoints[idx]);
+				collector.Init(idxPoint, pointcloud.points[idxPoint], 0);
+				axis += collector.cone.ray.m_vDir;
+				maxHeight = MAXF(maxHeight, collector.cone.maxHeight);
+			}
+			axis.normalize();
+			float cosSpread(1);
+			for (uint32_t idx=idxBatch; idx<idxBatchEnd; ++idx)
+				cosSpread = MINF(cosSpread, axis.dot(((const PointCloud::Point::EVec&)pointcloud.points[viewPoints[idx]]-ray.m_pOrig).normalized()));
+			const float spread(ACOS(CLAMP(cosSpread, -1.f, 1.f)));
+			if (idxBatchEnd-idxBatch > 1 && spread < angle*maxBatchSpread) {
+				// collect the candidate points once for the entire batch,
+				// and check each point only against these
+				Collector::Cone coneBatch(Ray3f(ray.m_pOrig, axis), spread+angle);
+				coneBatch.maxHeight = maxHeight;
+				candidates.Empty();
+				BatchCollector batchCollector(coneBatch, candidates);
+				octree.Collect(batchCollector, batchCollector);
+				for (uint32_t idx=idxBatch; idx<idxBatchEnd; ++idx) {
+					const PointCloud::Index idxPoint(viewPoints[idx]);
+					collector.Init(idxPoint, pointcloud.points[idxPoint], (int)pointcloud.pointViews[idxPoint].size());
+					collector(candidates.Begin(), (Collector::IDX)candidates.GetSize());
+				}
+			} else {
+				// the points are too far apart, check each of them independently
+				for (uint32_t idx=idxBatch; idx<idxBatchEnd; ++idx) {
+					const PointCloud::Index idxPoint(viewPoints[idx]);
+					collector.Init(idxPoint, pointcloud.points[idxPoint], (int)pointcloud.pointViews[idxPoint].size());
+					octree.Collect(collector, collector);
+				}
+			}
 		}
 		++progress;
 	}
@@ -1796,7 +3472,298 @@ void Scene::PointCloudFilter(int thRemove)
 		if (visibility[idxPoint] <= thRemove)
 			pointcloud.RemovePoint(idxPoint);
 	}
+	InvalidateImagePoints();
 
 	DEBUG_EXTRA("Point-cloud filtered: %u/%u points (%d%%%%) (%s)", pointcloud.points.size(), numInitPoints, ROUND2INT((100.f*pointcloud.points.GetSize())/numInitPoints), TD_TIMER_GET_FMT().c_str());
 } // PointCloudFilter
 /*----------------------------------------------------------------*/
+
+
+namespace {
+// uniform grid of cells bucketing the points of a point-cloud,
+// used for the fast k-nearest neighbors and radius searches
+class PointCloudGrid
+{
+public:
+	typedef PointCloud::Index Index;
+	struct Neighbor {
+		float distSq; // squared distance to the query point
+		Index idx; // index of the neighbor point
+		inline bool operator < (const Neighbor& rhs) const { return distSq < rhs.distSq; }
+	};
+	typedef std::vector<Neighbor> NeighborArr;
+
+public:
+	PointCloudGrid(const PointCloud::PointArr& _points, float _cellSize)
+		: points(_points), cellSize(_cellSize), invCellSize(1.f/_cellSize)
+	{
+		// sort the points by cell, and remember the range of points of each cell
+		std::vector<GridCell> keys(points.GetSize());
+		#ifdef DENSE_USE_OPENMP
+		#pragma omp parallel for
+		#endif
+		for (int64_t i=0; i<(int64_t)points.GetSize(); ++i)
+			keys[i] = GetCell(points[(Index)i]);
+		indices.Resize(points.GetSize());
+		FOREACH(i, indices)
+			indices[i] = i;
+		std::sort(indices.Begin(), indices.End(), [&keys](Index i, Index j) {
+			const GridCell& a = keys[i]; const GridCell& b = keys[j];
+			return a.z < b.z || (a.z == b.z && (a.y < b.y || (a.y == b.y && a.x < b.x)));
+		});
+		cells.reserve(points.GetSize()/8);
+		for (uint32_t i=0; i<indices.GetSize(); ) {
+			const GridCell& key(keys[indices[i]]);
+			uint32_t j(i+1);
+			while (j<indices.GetSize() && keys[indices[j]] == key)
+				++j;
+			cells.emplace(key, std::make_pair(i, j));
+			i = j;
+		}
+	}
+
+	// find the k nearest neighbors of the given point (including itself if part of the point-cloud),
+	// searching at most the given number of cells around it; returns them sorted by distance
+	void FindNearest(const PointCloud::Point& X, unsigned k, NeighborArr& neighbors, int maxRings=4) const {
+		neighbors.clear();
+		const GridCell c(GetCell(X));
+		for (int r=0; r<=maxRings; ++r) {
+			// visit only the cells on the border of the cube of radius r
+			for (int z=-r; z<=r; ++z) {
+				for (int y=-r; y<=r; ++y) {
+					const bool bBorder(ABS(z) == r || ABS(y) == r);
+					for (int x=-r; x<=r; x+=(bBorder || r == 0 ? 1 : 2*r)) {
+						const auto itCell(cells.find(GridCell(c.x+x, c.y+y, c.z+z)));
+						if (itCell == cells.end())
+							continue;
+						for (uint32_t i=itCell->second.first; i<itCell->second.second; ++i) {
+							const Index idx(indices[i]);
+							const Neighbor neighbor{normSq(points[idx]-X), idx};
+							if (neighbors.size() < k) {
+								neighbors.push_back(neighbor);
+								std::push_heap(neighbors.begin(), neighbors.end());
+							} else if (neighbor < neighbors.front()) {
+								std::pop_heap(neighbors.begin(), neighbors.end());
+								neighbors.back() = neighbor;
+								std::push_heap(neighbors.begin(), neighbors.end());
+							}
+						}
+					}
+				}
+			}
+			// the points in the next ring are at least r cells away
+			if (neighbors.size() == k && neighbors.front().distSq <= SQUARE(r*cellSize))
+				break;
+		}
+		std::sort_heap(neighbors.begin(), neighbors.end());
+	}
+
+	// count the points inside the sphere of the given radius around the given point
+	// (including itself if part of the point-cloud), stopping after the given count
+	unsigned CountInRadius(const PointCloud::Point& X, float radius, unsigned maxCount) const {
+		const float radiusSq(SQUARE(radius));
+		const GridCell cMin(GetCell(X-PointCloud::Point(radius,radius,radius)));
+		const GridCell cMax(GetCell(X+PointCloud::Point(radius,radius,radius)));
+		unsigned count(0);
+		for (int z=cMin.z; z<=cMax.z; ++z) {
+			for (int y=cMin.y; y<=cMax.y; ++y) {
+				for (int x=cMin.x; x<=cMax.x; ++x) {
+					const auto itCell(cells.find(GridCell(x, y, z)));
+					if (itCell == cells.end())
+						continue;
+					for (uint32_t i=itCell->second.first; i<itCell->second.second; ++i) {
+						if (normSq(points[indices[i]]-X) <= radiusSq && ++count >= maxCount)
+							return count;
+					}
+				}
+			}
+		}
+		return count;
+	}
+
+	// estimate the average distance between the points of a dense point-cloud
+	// as the average size of a pixel back-projected at the point depth
+	static float EstimatePointSpacing(const PointCloud& pointcloud, const ImageArr& images) {
+		const Index nPoints((Index)pointcloud.GetSize());
+		const Index nStep(MAXF(nPoints/1024u, 1u));
+		double sumGSD(0);
+		unsigned nSamples(0);
+		for (Index idxPoint=0; idxPoint<nPoints; idxPoint+=nStep) {
+			if (pointcloud.pointViews.IsEmpty() || pointcloud.pointViews[idxPoint].IsEmpty())
+				continue;
+			const Camera& camera = images[pointcloud.pointViews[idxPoint].First()].camera;
+			sumGSD += camera.PointDepth(pointcloud.points[idxPoint])/camera.GetFocalLength();
+			++nSamples;
+		}
+		if (nSamples == 0)
+			return 0;
+		return (float)(sumGSD/nSamples);
+	}
+
+protected:
+	inline GridCell GetCell(const PointCloud::Point& X) const {
+		return GetGridCell(X, invCellSize);
+	}
+
+protected:
+	const PointCloud::PointArr& points;
+	const float cellSize;
+	const float invCellSize;
+	PointCloud::IndexArr indices; // point indices sorted by cell
+	std::unordered_map<GridCell,std::pair<uint32_t,uint32_t>,GridCellHash> cells; // range of sorted indices of each cell
+};
+} // unnamed namespace
+
+// estimate the normal of each point by fitting a plane (PCA) to its k nearest neighbors,
+// and orient it toward the cameras seeing the point;
+// useful when the depth-maps do not have normal-maps
+void Scene::PointCloudEstimateNormals(unsigned nNeighbors)
+{
+	TD_TIMER_STARTD();
+	ASSERT(nNeighbors >= 3);
+	if (pointcloud.IsEmpty())
+		return;
+	const float spacing(PointCloudGrid::EstimatePointSpacing(pointcloud, images));
+	const PointCloudGrid grid(pointcloud.points, spacing > 0 ? spacing*2 : 1.f);
+	pointcloud.normals.Resize(pointcloud.GetSize());
+	#ifdef DENSE_USE_OPENMP
+	#pragma omp parallel
+	#endif
+	{
+	PointCloudGrid::NeighborArr neighbors;
+	neighbors.reserve(nNeighbors);
+	#ifdef DENSE_USE_OPENMP
+	#pragma omp for schedule(dynamic, 1024)
+	for (int64_t i=0; i<(int64_t)pointcloud.GetSize(); ++i) {
+		const PointCloud::Index idxPoint((PointCloud::Index)i);
+	#else
+	FOREACH(idxPoint, pointcloud.points) {
+	#endif
+		const PointCloud::Point& X = pointcloud.points[idxPoint];
+		PointCloud::Normal& normal = pointcloud.normals[idxPoint];
+		grid.FindNearest(X, nNeighbors, neighbors);
+		if (neighbors.size() < 3) {
+			normal = PointCloud::Normal::ZERO;
+			continue;
+		}
+		// fit a plane to the neighbors: the normal is the direction of least variance
+		Eigen::Vector3f mean(Eigen::Vector3f::Zero());
+		for (const PointCloudGrid::Neighbor& neighbor: neighbors)
+			mean += (const Eigen::Vector3f&)pointcloud.points[neighbor.idx];
+		mean /= (float)neighbors.size();
+		Eigen::Matrix3f cov(Eigen::Matrix3f::Zero());
+		for (const PointCloudGrid::Neighbor& neighbor: neighbors) {
+			const Eigen::Vector3f d((const Eigen::Vector3f&)pointcloud.points[neighbor.idx]-mean);
+			cov.noalias() += d*d.transpose();
+		}
+		const Eigen::SelfAdjointEigenSolver<Eigen::Matrix3f> es(cov);
+		(Eigen::Vector3f&)normal = es.eigenvectors().col(0);
+		// orient the normal toward the cameras seeing the point
+		if (!pointcloud.pointViews.IsEmpty()) {
+			PointCloud::Normal viewDir(PointCloud::Normal::ZERO);
+			for (PointCloud::View idxView: pointcloud.pointViews[idxPoint])
+				viewDir += normalized(Cast<float>(images[idxView].camera.C)-X);
+			if (normal.dot(viewDir) < 0)
+				normal = -normal;
+		}
+	}
+	}
+	DEBUG_EXTRA("Point-cloud normals estimated using %u neighbors: %u points (%s)", nNeighbors, pointcloud.GetSize(), TD_TIMER_GET_FMT().c_str());
+} // PointCloudEstimateNormals
+/*----------------------------------------------------------------*/
+
+// remove the outlier points:
+//  - statistical: the points whose mean distance to their k nearest neighbors
+//    is larger than the mean over all points plus the given number of standard deviations
+//    (the points without any neighbor in the searched cells are not judged)
+//  - radius: the points with less than the given number of neighbors inside the given radius
+// each pass uses its own spatial grid: sized by the point spacing for the nearest neighbors
+// (so the result does not depend on the radius), and by the radius for the radius search;
+// the passes are disabled if nNeighbors or fRadius are 0
+void Scene::PointCloudRemoveOutliers(unsigned nNeighbors, float fStdDevMul, float fRadius, unsigned nMinNeighbors)
+{
+	TD_TIMER_STARTD();
+	if (pointcloud.IsEmpty() || (nNeighbors == 0 && fRadius <= 0))
+		return;
+	BoolArr outliers(pointcloud.GetSize());
+	outliers.Memset(0);
+	size_t nOutliersStat(0), nOutliersRadius(0);
+
+	if (nNeighbors > 0) {
+		const float spacing(PointCloudGrid::EstimatePointSpacing(pointcloud, images));
+		const PointCloudGrid grid(pointcloud.points, spacing > 0 ? spacing*2 : 1.f);
+		// compute the mean distance of each point to its nearest neighbors (itself excluded)
+		FloatArr meanDists(pointcloud.GetSize());
+		#ifdef DENSE_USE_OPENMP
+		#pragma omp parallel
+		#endif
+		{
+		PointCloudGrid::NeighborArr neighbors;
+		neighbors.reserve(nNeighbors+1);
+		#ifdef DENSE_USE_OPENMP
+		#pragma omp for schedule(dynamic, 1024)
+		for (int64_t i=0; i<(int64_t)pointcloud.GetSize(); ++i) {
+			const PointCloud::Index idxPoint((PointCloud::Index)i);
+		#else
+		FOREACH(idxPoint, pointcloud.points) {
+		#endif
+			grid.FindNearest(pointcloud.points[idxPoint], nNeighbors+1, neighbors);
+			float sumDist(0);
+			for (const PointCloudGrid::Neighbor& neighbor: neighbors)
+				sumDist += SQRT(neighbor.distSq);
+			meanDists[idxPoint] = (neighbors.size() > 1 ? sumDist/(neighbors.size()-1) : FLT_MAX);
+		}
+		}
+		// remove the points too far from their neighbors compared to the rest
+		double sum(0), sumSq(0);
+		size_t count(0);
+		for (float dist: meanDists) {
+			if (dist == FLT_MAX)
+				continue;
+			sum += dist;
+			sumSq += SQUARE((double)dist);
+			++count;
+		}
+		if (count > 0) {
+			const double mean(sum/count);
+			const double stdDev(SQRT(MAXF(sumSq/count-SQUARE(mean), 0.0)));
+			const float thDist((float)(mean+fStdDevMul*stdDev));
+			FOREACH(idxPoint, pointcloud.points) {
+				if (meanDists[idxPoint] != FLT_MAX && meanDists[idxPoint] > thDist) {
+					outliers[idxPoint] = true;
+					++nOutliersStat;
+				}
+			}
+		}
+	}
+
+	if (fRadius > 0) {
+		const PointCloudGrid grid(pointcloud.points, fRadius);
+		// remove the points with too few neighbors around them (itself excluded)
+		#ifdef DENSE_USE_OPENMP
+		#pragma omp parallel for schedule(dynamic, 1024) reduction(+:nOutliersRadius)
+		for (int64_t i=0; i<(int64_t)pointcloud.GetSize(); ++i) {
+			const PointCloud::Index idxPoint((PointCloud::Index)i);
+		#else
+		FOREACH(idxPoint, pointcloud.points) {
+		#endif
+			if (outliers[idxPoint])
+				continue;
+			if (grid.CountInRadius(pointcloud.points[idxPoint], fRadius, nMinNeighbors+1) < nMinNeighbors+1) {
+				outliers[idxPoint] = true;
+				++nOutliersRadius;
+			}
+		}
+	}
+
+	// filter points
+	const size_t numInitPoints(pointcloud.GetSize());
+	RFOREACH(idxPoint, pointcloud.points) {
+		if (outliers[idxPoint])
+			pointcloud.RemovePoint(idxPoint);
+	}
+	InvalidateImagePoints();
+
+	DEBUG_EXTRA("Point-cloud outliers removed: %u statistical, %u radius outliers; %u/%u points remaining (%s)", nOutliersStat, nOutliersRadius, pointcloud.GetSize(), numInitPoints, TD_TIMER_GET_FMT().c_str());
+} // PointCloudRemoveOutliers
+/*----------------------------------------------------------------*/
@@ -48,6 +48,55 @@ class MVS_API Scene;
 class PatchMatchCUDA;
 #endif // _USE_CUDA
 
+// additional dense options, set by the application
+// (not stored in the dense configuration file)
+namespace OPTDENSE {
+extern String strFusionStatsFileName; // file (.csv or .json) where to export the fusion counters (empty - disabled)
+extern float fFusionSpacing; // minimum distance between the fused points, keeping the best sample in each grid cell (0 - disabled)
+extern unsigned nFusionMaxPoints; // maximum number of fused points, coarsening the decimation grid as needed (0 - disabled)
+extern float fViewMinGain; // stop adding target views once their coverage and baseline gain drops below this ratio (0 - disabled)
+extern float fViewTimeBudget; // stop adding target views once the predicted depth-map estimation time exceeds this (seconds, 0 - disabled)
+extern unsigned nImageRangeBegin; // estimate only the depth-maps of the images in the range [begin, end) (ex. a shard of the scene)
+extern unsigned nImageRangeEnd; // end of the range of images to estimate (0 - all images)
+} // namespace OPTDENSE
+
+// cell of a uniform grid over the 3D space, used as key of the sparse grids bucketing points;
+// the full integer coordinates are hashed, so that distant cells never alias
+typedef TPoint3<int> GridCell;
+struct GridCellHash {
+	inline size_t operator()(const GridCell& c) const {
+		uint64_t h((uint32_t)c.x);
+		h = h*0x9E3779B97F4A7C15ull ^ (uint32_t)c.y;
+		h = h*0x9E3779B97F4A7C15ull ^ (uint32_t)c.z;
+		return (size_t)(h ^ (h >> 32));
+	}
+};
+inline GridCell GetGridCell(const Point3f& X, float invCellSize) {
+	return GridCell(FLOOR2INT(X.x*invCellSize), FLOOR2INT(X.y*invCellSize), FLOOR2INT(X.z*invCellSize));
+}
+
+// counters collected while fusing the depth-map of a reference image
+struct MVS_API FusionStats {
+	IIndex idxImage; // reference image index
+	uint32_t nNeighbors; // number of neighbor depth-maps checked for each depth
+	uint32_t nDepths; // valid depths of the reference depth-map
+	uint32_t nDepthsFused; // depths skipped as already fused into an existing point
+	uint32_t nRejectedDepth; // neighbor candidates rejected for depth disagreement
+	uint32_t nRejectedNormal; // neighbor candidates rejected for normal disagreement
+	uint32_t nRejectedViews; // points discarded for being seen by less than nMinViewsFuse views
+	uint32_t nInvalidatedDepths; // neighbor depths invalidated by a fused point in front of them
+	uint32_t nOutside; // neighbor lookups falling behind the camera or outside the depth-map
+	uint32_t nPoints; // new points (kept as new cells of the decimation grid, if any)
+	uint32_t nMerged; // fused points merged into an existing cell of the decimation grid
+	float time; // fusion time (ms)
+	Unsigned32Arr neighborMatches; // views added to the fused points by each neighbor (in neighbor order)
+
+	FusionStats(IIndex _idxImage=NO_ID) : idxImage(_idxImage),
+		nNeighbors(0), nDepths(0), nDepthsFused(0), nRejectedDepth(0), nRejectedNormal(0),
+		nRejectedViews(0), nInvalidatedDepths(0), nOutside(0), nPoints(0), nMerged(0), time(0) {}
+};
+typedef cList<FusionStats,const FusionStats&,2,16,IIndex> FusionStatsArr;
+
 // structure used to compute all depth-maps
 class MVS_API DepthMapsData
 {
@@ -57,6 +106,8 @@ public:
 
 	bool SelectViews(DepthData& depthData);
 	bool InitViews(DepthData& depthData, IIndex idxNeighbor, IIndex numNeighbors, bool loadImages, int loadDepthMaps);
+	IIndex AdaptiveNumViews(const DepthData& depthData, IIndex numViews, float& predictedTime);
+	void UpdateViewCost(IIndex idxImage, float time);
 	bool InitDepthMap(DepthData& depthData);
 	bool EstimateDepthMap(IIndex idxImage, int nGeometricIter);
 
@@ -64,8 +115,12 @@ public:
 	bool GapInterpolation(DepthData& depthData);
 
 	bool FilterDepthMap(DepthData& depthData, const IIndexArr& idxNeighbors, bool bAdjust=true);
+	static unsigned FilterSplatThreads(unsigned nThreads, const cv::Size& size);
+	static size_t FilterSplatMemory(unsigned nThreads, const cv::Size& size);
 	void MergeDepthMaps(PointCloud& pointcloud, bool bEstimateColor, bool bEstimateNormal);
-	void FuseDepthMaps(PointCloud& pointcloud, bool bEstimateColor, bool bEstimateNormal);
+	void FuseDepthMaps(PointCloud& pointcloud, bool bEstimateColor, bool bEstimateNormal, const IIndexArr* pNewImages=NULL);
+
+	bool ExportFusionStats(const String& fileName) const;
 
 protected:
 	static void* STCALL ScoreDepthMapTmp(void*);
@@ -77,6 +132,21 @@ public:
 
 	DepthDataArr arrDepthData;
 
+	FusionStatsArr fusionStats; // per reference image counters collected by the last fusion
+	volatile Thread::safe_t nFilterJobs; // number of depth-maps currently being filtered
+	volatile Thread::safe_t nEstimationJobs; // number of depth-maps currently being estimated (using all threads)
+
+	// reusable buffers of the segment labeling, one for each concurrent RemoveSmallSegments() call
+	CriticalSection csSegmentBuffers;
+	std::vector<std::vector<uint32_t>> segmentBuffers;
+
+	// used internally to adapt the number of target views per reference image
+	CriticalSection csViewCost;
+	double fViewCost; // calibrated estimation time per reference pixel and target view (seconds, 0 - not calibrated yet)
+	unsigned nViewCostSamples; // number of estimated depth-maps the calibration is averaged over
+	CLISTDEF0IDX(float,IIndex) arrPredictedTime; // predicted estimation time of each depth-map (seconds, 0 - not predicted)
+	CLISTDEF0IDX(IIndex,IIndex) arrNumViews; // number of target views selected for each depth-map (0 - not adapted)
+
 	// used internally to estimate the depth-maps
 	Image8U::Size prevDepthMapSize; // remember the size of the last estimated depth-map
 	Image8U::Size prevDepthMapSizeTrg; // ... same for target image
@@ -101,12 +171,27 @@ struct MVS_API DenseDepthMapData {
 	CAutoPtr<Util::Progress> progress;
 	int nEstimationGeometricIter;
 	int nFusionMode;
+	bool bReuseDepthMaps; // existing depth-maps are used as they are, without being optimized or filtered again
+	BoolArr reusedDepthMaps; // for each image to be processed, set if its depth-map already existed (only if bReuseDepthMaps)
+	bool bWorker; // the depth-maps are claimed through lock-files in the working folder, shared with other processes
+	float fLockTimeout; // seconds after which the lock of a depth-map not completed is considered abandoned (0 - never)
+	CriticalSection csLocks;
+	std::unordered_set<uint32_t> lockedDepthMaps; // IDs of the depth-maps claimed by this worker and not completed yet
+	SEACAVE::Thread threadHeartbeat; // periodically refreshes the locks of the claimed depth-maps
+	volatile bool bStopHeartbeat; // set when the heartbeat thread is not running or should stop
 	STEREO::SemiGlobalMatcher sgm;
 
-	DenseDepthMapData(Scene& _scene, int _nFusionMode=0);
+	DenseDepthMapData(Scene& _scene, int _nFusionMode=0, bool _bReuseDepthMaps=false);
 	~DenseDepthMapData();
 
 	void SignalCompleteDepthmapFilter();
+
+	bool ClaimDepthMap(IIndex idxImage);
+	void CompleteDepthMap(IIndex idxImage);
+
+	void StartHeartbeat();
+	void StopHeartbeat();
+	static void* STCALL HeartbeatTmp(void*);
 };
 /*----------------------------------------------------------------*/
 
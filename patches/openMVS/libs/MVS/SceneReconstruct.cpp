@@ -41,6 +41,7 @@
 #include <CGAL/AABB_traits.h>
 #include <CGAL/AABB_triangle_primitive.h>
 #include <CGAL/Polyhedron_3.h>
+#include <numeric>
 
 using namespace MVS;
 
@@ -715,22 +716,136 @@ float computePlaneSphereAngle(const delaunay_t& Tr, const facet_t& facet)
 }
 } // namespace DELAUNAY
 
+namespace {
+// check if the point is inside the cell, considering the cell open on the max side,
+// so a point on the border between two cells is inside only one of them
+inline bool IsInsideCell(const AABB3f& cell, const Point3f& X)
+{
+	for (int i=0; i<3; ++i)
+		if (X[i] < cell.ptMin[i] || X[i] >= cell.ptMax[i])
+			return false;
+	return true;
+}
+// check if the two cells overlap
+inline bool IsOverlapping(const AABB3f& a, const AABB3f& b)
+{
+	for (int i=0; i<3; ++i)
+		if (a.ptMax[i] <= b.ptMin[i] || b.ptMax[i] <= a.ptMin[i])
+			return false;
+	return true;
+}
+// compute the cell containing all points (or only the given ones), including the ones on the max side
+AABB3f BoundingCell(const PointCloud::PointArr& points, const PointCloud::Index* begin=NULL, const PointCloud::Index* end=NULL)
+{
+	AABB3f cell;
+	cell.ptMin = AABB3f::POINT::Constant(FLT_MAX);
+	cell.ptMax = AABB3f::POINT::Constant(-FLT_MAX);
+	const auto Insert = [&cell](const PointCloud::Point& X) {
+		for (int i=0; i<3; ++i) {
+			cell.ptMin[i] = MINF(cell.ptMin[i], X[i]);
+			cell.ptMax[i] = MAXF(cell.ptMax[i], X[i]);
+		}
+	};
+	if (begin == NULL) {
+		for (const PointCloud::Point& X: points)
+			Insert(X);
+	} else {
+		for (const PointCloud::Index* pIdx=begin; pIdx!=end; ++pIdx)
+			Insert(points[*pIdx]);
+	}
+	cell.ptMax += (cell.ptMax-cell.ptMin)*0.001f+AABB3f::POINT::Constant(1e-6f);
+	return cell;
+}
+// split recursively the given cell at the median point along its longest axis,
+// until it contains at most nMaxPoints points; the resulting cells tile the space
+// (the points of each cell are stored contiguously, in the order of the cells, and counted in pCellsSize)
+void SplitPointCloud(const PointCloud::PointArr& points, PointCloud::Index* begin, PointCloud::Index* end,
+	const AABB3f& cell, unsigned nMaxPoints, std::vector<AABB3f>& cells, std::vector<PointCloud::Index>* pCellsSize=NULL)
+{
+	if ((size_t)(end-begin) <= nMaxPoints) {
+		cells.emplace_back(cell);
+		if (pCellsSize)
+			pCellsSize->emplace_back((PointCloud::Index)(end-begin));
+		return;
+	}
+	int axis;
+	(cell.ptMax-cell.ptMin).maxCoeff(&axis);
+	PointCloud::Index* const mid(begin+(end-begin)/2);
+	std::nth_element(begin, mid, end, [&](PointCloud::Index a, PointCloud::Index b) {
+		return points[a][axis] < points[b][axis];
+	});
+	AABB3f cellLow(cell), cellHigh(cell);
+	cellLow.ptMax[axis] = cellHigh.ptMin[axis] = points[*mid][axis];
+	SplitPointCloud(points, begin, mid, cellLow, nMaxPoints, cells, pCellsSize);
+	SplitPointCloud(points, mid, end, cellHigh, nMaxPoints, cells, pCellsSize);
+}
+// gather the points inside each region, given the points partitioned in cells as by SplitPointCloud();
+// the points of a cell are tested only against the regions overlapping it
+void GatherRegions(const PointCloud::PointArr& points, const std::vector<PointCloud::Index>& indices,
+	const std::vector<AABB3f>& cells, const std::vector<PointCloud::Index>& cellsSize,
+	const std::vector<AABB3f>& regions, std::vector<std::vector<PointCloud::Index>>& regionsIndices)
+{
+	regionsIndices.clear();
+	regionsIndices.resize(regions.size());
+	const PointCloud::Index* pBegin(indices.data());
+	for (size_t c=0; c<cells.size(); ++c) {
+		const PointCloud::Index* const pEnd(pBegin+cellsSize[c]);
+		for (size_t r=0; r<regions.size(); ++r) {
+			if (!IsOverlapping(regions[r], cells[c]))
+				continue;
+			std::vector<PointCloud::Index>& regionIndices = regionsIndices[r];
+			for (const PointCloud::Index* pIdx=pBegin; pIdx!=pEnd; ++pIdx)
+				if (IsInsideCell(regions[r], points[*pIdx]))
+					regionIndices.emplace_back(*pIdx);
+		}
+		pBegin = pEnd;
+	}
+}
+// distance from the point inside the given cell to the nearest border shared with another cell
+// (the borders on the bounds are not seams), relative to the half-width of the seam band
+// (fBand times the cell size along each axis): less than 1 inside the band
+float SeamDistance(const AABB3f& bounds, const AABB3f& cell, float fBand, const Point3f& X)
+{
+	float dist(FLT_MAX);
+	for (int i=0; i<3; ++i) {
+		const float band((cell.ptMax[i]-cell.ptMin[i])*fBand);
+		if (band <= 0)
+			continue;
+		if (cell.ptMin[i] > bounds.ptMin[i])
+			dist = MINF(dist, (X[i]-cell.ptMin[i])/band);
+		if (cell.ptMax[i] < bounds.ptMax[i])
+			dist = MINF(dist, (cell.ptMax[i]-X[i])/band);
+	}
+	return dist;
+}
+} // unnamed namespace
+
 // First, iteratively create a Delaunay triangulation of the existing point-cloud by inserting point by point,
 // iif the point to be inserted is not closer than distInsert pixels in at least one of its views to
 // the projection of any of already inserted points.
 // Next, the score is computed for all the edges of the directed graph composed of points as vertices.
 // Finally, graph-cut algorithm is used to split the tetrahedrons in inside and outside,
 // and the surface is such extracted.
+// If nMaxChunkPoints is not 0 and the point-cloud is larger, the space is split in chunks
+// reconstructed independently (see ReconstructMeshChunks), so the peak memory follows the chunk size.
 bool Scene::ReconstructMesh(float distInsert, bool bUseFreeSpaceSupport, unsigned nItersFixNonManifold,
 							float kSigma, float kQual, float kb,
 							float kf, float kRel, float kAbs, float kOutl,
-							float kInf
+							float kInf,
+							unsigned nMaxChunkPoints, float fChunkOverlap
 )
 {
 	using namespace DELAUNAY;
 	ASSERT(!pointcloud.IsEmpty());
 	mesh.Release();
 
+	if (nMaxChunkPoints > 0 && pointcloud.GetSize() > nMaxChunkPoints) {
+		// reconstruct each chunk with the same parameters and stitch the surfaces
+		return ReconstructMeshChunks(nMaxChunkPoints, fChunkOverlap, [&](Scene& chunk) {
+			return chunk.ReconstructMesh(distInsert, bUseFreeSpaceSupport, nItersFixNonManifold, kSigma, kQual, kb, kf, kRel, kAbs, kOutl, kInf);
+		}, nItersFixNonManifold);
+	}
+
 	// create the Delaunay triangulation
 	delaunay_t delaunay;
 	std::vector<cell_info_t> infoCells;
@@ -753,10 +868,9 @@ bool Scene::ReconstructMesh(float distInsert, bool bUseFreeSpaceSupport, unsigne
 		// insert vertices
 		Util::Progress progress(_T("Points inserted"), indices.size());
 		const float distInsertSq(SQUARE(distInsert));
-		vertex_handle_t hint;
-		delaunay_t::Locate_type lt;
-		int li, lj;
-		std::for_each(indices.cbegin(), indices.cend(), [&](size_t idx) {
+		// insert the point in the triangulation only if it is far enough to all existing points,
+		// and return the vertex representing it (the new vertex, or the nearest one if not inserted)
+		const auto insertPoint = [&](delaunay_t& Tr, size_t idx, const vertex_handle_t& hint) -> vertex_handle_t {
 			const point_t& p = vertices[idx];
 			const PointCloud::Point& point = pointcloud.points[idx];
 			const PointCloud::ViewArr& views = pointcloud.pointViews[idx];
@@ -764,68 +878,178 @@ bool Scene::ReconstructMesh(float distInsert, bool bUseFreeSpaceSupport, unsigne
 			if (hint == vertex_handle_t()) {
 				// this is the first point,
 				// insert it
-				hint = delaunay.insert(p);
-				ASSERT(hint != vertex_handle_t());
-			} else
+				return Tr.insert(p);
+			}
 			if (distInsert <= 0) {
 				// insert all points
-				hint = delaunay.insert(p, hint);
-				ASSERT(hint != vertex_handle_t());
+				return Tr.insert(p, hint);
+			}
+			// locate cell containing this point
+			delaunay_t::Locate_type lt;
+			int li, lj;
+			const cell_handle_t c(Tr.locate(p, lt, li, lj, hint->cell()));
+			if (lt == delaunay_t::VERTEX) {
+				// duplicate point, nothing to insert,
+				// just update its visibility info
+				ASSERT(c->vertex(li) != Tr.infinite_vertex());
+				return c->vertex(li);
+			}
+			// locate the nearest vertex
+			vertex_handle_t nearest;
+			if (Tr.dimension() < 3) {
+				// use a brute-force algorithm if dimension < 3
+				delaunay_t::Finite_vertices_iterator vit = Tr.finite_vertices_begin();
+				nearest = vit;
+				++vit;
+				adjacent_vertex_back_inserter_t inserter(Tr, p, nearest);
+				for (delaunay_t::Finite_vertices_iterator end = Tr.finite_vertices_end(); vit != end; ++vit)
+					inserter = vit;
 			} else {
-				// locate cell containing this point
-				const cell_handle_t c(delaunay.locate(p, lt, li, lj, hint->cell()));
-				if (lt == delaunay_t::VERTEX) {
-					// duplicate point, nothing to insert,
-					// just update its visibility info
-					hint = c->vertex(li);
-					ASSERT(hint != delaunay.infinite_vertex());
-				} else {
-					// locate the nearest vertex
-					vertex_handle_t nearest;
-					if (delaunay.dimension() < 3) {
-						// use a brute-force algorithm if dimension < 3
-						delaunay_t::Finite_vertices_iterator vit = delaunay.finite_vertices_begin();
-						nearest = vit;
-						++vit;
-						adjacent_vertex_back_inserter_t inserter(delaunay, p, nearest);
-						for (delaunay_t::Finite_vertices_iterator end = delaunay.finite_vertices_end(); vit != end; ++vit)
-							inserter = vit;
-					} else {
-						// - start with the closest vertex from the located cell
-						// - repeatedly take the nearest of its incident vertices if any
-						// - if not, we're done
-						ASSERT(c != cell_handle_t());
-						nearest = delaunay.nearest_vertex_in_cell(p, c);
-						while (true) {
-							const vertex_handle_t v(nearest);
-							delaunay.adjacent_vertices(nearest, adjacent_vertex_back_inserter_t(delaunay, p, nearest));
-							if (v == nearest)
+				// - start with the closest vertex from the located cell
+				// - repeatedly take the nearest of its incident vertices if any
+				// - if not, we're done
+				ASSERT(c != cell_handle_t());
+				nearest = Tr.nearest_vertex_in_cell(p, c);
+				while (true) {
+					const vertex_handle_t v(nearest);
+					Tr.adjacent_vertices(nearest, adjacent_vertex_back_inserter_t(Tr, p, nearest));
+					if (v == nearest)
+						break;
+				}
+			}
+			ASSERT(nearest == Tr.nearest_vertex(p, hint->cell()));
+			// check if point is far enough to all existing points
+			FOREACHPTR(pViewID, views) {
+				const Image& imageData = images[*pViewID];
+				const Point3f pn(imageData.camera.ProjectPointP3(point));
+				const Point3f pe(imageData.camera.ProjectPointP3(CGAL2MVS<float>(nearest->point())));
+				if (!IsDepthSimilar(pn.z, pe.z) || normSq(Point2f(pn)-Point2f(pe)) > distInsertSq) {
+					// point far enough to an existing point,
+					// insert as a new point
+					return Tr.insert(p, lt, c, li, lj);
+				}
+			}
+			return nearest;
+		};
+		vertex_handle_t hint;
+		#ifdef DELAUNAY_USE_OPENMP
+		if (distInsert > 0 && nMaxThreads > 1 && indices.size() > 1000000) {
+			// filter the points in parallel: split the space in cells (several per thread),
+			// each filtering its points in the same (spatially sorted) order against a local triangulation;
+			// the points closer to the border of another cell than the area where a point can be
+			// found too close to another are deferred, and filtered serially against the global triangulation
+			const AABB3f bounds(BoundingCell(pointcloud.points));
+			std::vector<AABB3f> cells;
+			std::vector<PointCloud::Index> cellsSize;
+			std::vector<PointCloud::Index> cellIndices(indices.size());
+			std::iota(cellIndices.begin(), cellIndices.end(), PointCloud::Index(0));
+			SplitPointCloud(pointcloud.points, cellIndices.data(), cellIndices.data()+cellIndices.size(), bounds,
+				(unsigned)((indices.size()+nMaxThreads*4-1)/(nMaxThreads*4)), cells, &cellsSize);
+			// the border margin is twice the largest footprint of distInsert pixels,
+			// over all points and all their views (any view can reject a point)
+			float margin(0);
+			for (size_t idx: indices) {
+				const PointCloud::Point& X = pointcloud.points[idx];
+				FOREACHPTR(pViewID, pointcloud.pointViews[idx]) {
+					const Camera& camera = images[*pViewID].camera;
+					margin = MAXF(margin, distInsert*camera.ProjectPointP3(X).z/(float)MINF(camera.K(0,0), camera.K(1,1)));
+				}
+			}
+			margin *= 2;
+			// assign each point to its cell, or defer it if near the border with another cell
+			const IIndex nCells((IIndex)cells.size());
+			std::vector<std::vector<PointCloud::Index>> cellsPoints(nCells);
+			std::vector<PointCloud::Index> deferredPoints;
+			{
+				std::vector<IIndex> pointCells(indices.size());
+				PointCloud::Index* pIdx(cellIndices.data());
+				for (IIndex idxCell=0; idxCell<nCells; ++idxCell) {
+					const AABB3f& cell = cells[idxCell];
+					for (PointCloud::Index* const pEnd(pIdx+cellsSize[idxCell]); pIdx<pEnd; ++pIdx) {
+						const PointCloud::Point& X = pointcloud.points[*pIdx];
+						IIndex& pointCell = pointCells[*pIdx];
+						pointCell = idxCell;
+						for (int k=0; k<3; ++k) {
+							if ((cell.ptMin[k] > bounds.ptMin[k] && X[k]-cell.ptMin[k] < margin) ||
+								(cell.ptMax[k] < bounds.ptMax[k] && cell.ptMax[k]-X[k] < margin)) {
+								pointCell = NO_ID;
 								break;
+							}
 						}
 					}
-					ASSERT(nearest == delaunay.nearest_vertex(p, hint->cell()));
-					hint = nearest;
-					// check if point is far enough to all existing points
-					FOREACHPTR(pViewID, views) {
-						const Image& imageData = images[*pViewID];
-						const Point3f pn(imageData.camera.ProjectPointP3(point));
-						const Point3f pe(imageData.camera.ProjectPointP3(CGAL2MVS<float>(nearest->point())));
-						if (!IsDepthSimilar(pn.z, pe.z) || normSq(Point2f(pn)-Point2f(pe)) > distInsertSq) {
-							// point far enough to an existing point,
-							// insert as a new point
-							hint = delaunay.insert(p, lt, c, li, lj);
-							ASSERT(hint != vertex_handle_t());
-							break;
-						}
-					}
 				}
+				cellIndices.clear();
+				cellIndices.shrink_to_fit();
+				for (size_t idx: indices) {
+					if (pointCells[idx] == NO_ID)
+						deferredPoints.emplace_back((PointCloud::Index)idx);
+					else
+						cellsPoints[pointCells[idx]].emplace_back((PointCloud::Index)idx);
+				}
+			}
+			// filter the points of each cell, storing for each point the point representing it
+			const Timer::SysType timeFilter(Timer::GetSysTime());
+			std::vector<PointCloud::Index> representatives(indices.size(), NO_ID);
+			#pragma omp parallel for schedule(dynamic)
+			for (int64_t c=0; c<(int64_t)nCells; ++c) {
+				delaunay_t cellDelaunay;
+				std::unordered_map<void*,PointCloud::Index> mapVertices;
+				vertex_handle_t cellHint;
+				for (PointCloud::Index idx: cellsPoints[c]) {
+					cellHint = insertPoint(cellDelaunay, idx, cellHint);
+					representatives[idx] = mapVertices.emplace(cellHint.for_compact_container(), idx).first->second;
+					++progress;
+				}
+				cellsPoints[c].clear();
+				cellsPoints[c].shrink_to_fit();
+			}
+			// insert the kept points in the global triangulation, and add the visibility
+			// of the points filtered out to the vertex of the point representing them;
+			// each kept point is so inserted twice, once in its cell and once in the global triangulation,
+			// and this second insertion is serial: the gain is only in the point location and nearest vertex walks
+			// done for the filtered out points, so it depends on the ratio of points filtered out by distInsert
+			const Timer::SysType timeInsert(Timer::GetSysTime());
+			PointCloud::Index nKept(0), nMerged(0);
+			std::vector<vertex_handle_t> pointVertices(indices.size());
+			for (size_t idx: indices) {
+				if (representatives[idx] != idx) {
+					if (representatives[idx] != NO_ID)
+						++nMerged;
+					continue;
+				}
+				++nKept;
+				hint = (hint == vertex_handle_t() ? delaunay.insert(vertices[idx]) : delaunay.insert(vertices[idx], hint));
+				ASSERT(hint != vertex_handle_t());
+				pointVertices[idx] = hint;
 			}
+			for (size_t idx: indices)
+				if (representatives[idx] != NO_ID)
+					pointVertices[representatives[idx]]->info().InsertViews(pointcloud, idx);
+			// filter serially the deferred points
+			const Timer::SysType timeDeferred(Timer::GetSysTime());
+			for (PointCloud::Index idx: deferredPoints) {
+				hint = insertPoint(delaunay, idx, hint);
+				ASSERT(hint != vertex_handle_t());
+				hint->info().InsertViews(pointcloud, idx);
+				++progress;
+			}
+			// report the counts and the time of each stage, to be compared with the serial path
+			// (the same points -> vertices line is logged below by both paths)
+			DEBUG_EXTRA("Delaunay points filtered in parallel in %u cells (%g margin): %u kept, %u merged, %u deferred (%.3fs filter, %.3fs kept insertion, %.3fs deferred)",
+				nCells, margin, nKept, nMerged, (PointCloud::Index)deferredPoints.size(),
+				Timer::SysTime2TimeMs(timeInsert-timeFilter)/1000.0, Timer::SysTime2TimeMs(timeDeferred-timeInsert)/1000.0, Timer::SysTime2TimeMs(Timer::GetSysTime()-timeDeferred)/1000.0);
+		} else
+		#endif
+		for (size_t idx: indices) {
+			hint = insertPoint(delaunay, idx, hint);
+			ASSERT(hint != vertex_handle_t());
 			// update point visibility info
 			hint->info().InsertViews(pointcloud, idx);
 			++progress;
-		});
+		}
 		progress.close();
 		pointcloud.Release();
+		InvalidateImagePoints();
 		// init cells weights and
 		// loop over all cells and store the finite facet of the infinite cells
 		const size_t numNodes(delaunay.number_of_cells());
@@ -1114,3 +1338,194 @@ bool Scene::ReconstructMesh(float distInsert, bool bUseFreeSpaceSupport, unsigne
 	return true;
 }
 /*----------------------------------------------------------------*/
+
+// Split the space in cells of at most nMaxChunkPoints points each, and reconstruct the mesh
+// of each cell independently (in parallel), from the points inside the cell enlarged by
+// the fChunkOverlap margin (ratio of the cell size). The independent reconstructions
+// do not agree near the cell borders (they see different points), so cropping them at
+// the borders would leave cracks and overlapping slivers along the seams. Instead, each chunk
+// mesh keeps only the faces centered inside its cell and away from the seams, and the band
+// along the seams (half the margin wide on each side) is reconstructed again in chunks of its own,
+// from the points around the band, keeping only their faces centered inside the band.
+// The band and chunk meshes overlap outside the band, where they are built from the same points,
+// so most faces meet exactly and are stitched by merging the vertices having the same position
+// (the mesh vertices are input points); small holes can still remain where they meet,
+// and should be closed by the mesh cleaning that follows the reconstruction.
+// The peak memory follows the chunk size times the number of chunks processed concurrently.
+// If nMaxChunkPoints is 0 or the point-cloud is not larger, the whole scene is reconstructed at once.
+bool Scene::ReconstructMeshChunks(unsigned nMaxChunkPoints, float fChunkOverlap, const std::function<bool(Scene&)>& reconstructChunk, unsigned nItersFixNonManifold)
+{
+	if (nMaxChunkPoints == 0 || pointcloud.GetSize() <= nMaxChunkPoints)
+		return reconstructChunk(*this);
+	TD_TIMER_STARTD();
+	mesh.Release();
+	const float fBand(fChunkOverlap*0.5f);
+	struct Chunk {
+		AABB3f cell; // the faces centered inside this cell are kept
+		std::vector<PointCloud::Index> indices; // the points to reconstruct from
+		std::vector<uint32_t> cells; // for the seam chunks, the cells overlapping it
+		Mesh mesh;
+		bool bSeam;
+	};
+
+	// partition the point-cloud in cells, and gather the points of each cell enlarged by its margin
+	const AABB3f bounds(BoundingCell(pointcloud.points));
+	std::vector<AABB3f> cells;
+	std::vector<PointCloud::Index> cellsSize;
+	std::vector<PointCloud::Index> indices(pointcloud.points.size());
+	std::iota(indices.begin(), indices.end(), PointCloud::Index(0));
+	SplitPointCloud(pointcloud.points, indices.data(), indices.data()+indices.size(), bounds, nMaxChunkPoints, cells, &cellsSize);
+	std::vector<std::vector<PointCloud::Index>> regionsIndices;
+	{
+		std::vector<AABB3f> regions(cells);
+		for (AABB3f& region: regions) {
+			const AABB3f::POINT margin((region.ptMax-region.ptMin)*fChunkOverlap);
+			region.ptMin -= margin;
+			region.ptMax += margin;
+		}
+		GatherRegions(pointcloud.points, indices, cells, cellsSize, regions, regionsIndices);
+	}
+
+	// split in the same way the band along the seams, gathering the points around it
+	// (up to twice the band half-width from the seams), so the band is reconstructed with its surroundings
+	std::vector<AABB3f> seamCells, seamRegions;
+	std::vector<std::vector<PointCloud::Index>> seamRegionsIndices;
+	if (fBand > 0 && cells.size() > 1) {
+		std::vector<PointCloud::Index> poolIndices;
+		AABB3f::POINT maxBand(AABB3f::POINT::Zero());
+		const PointCloud::Index* pIdx(indices.data());
+		for (size_t c=0; c<cells.size(); ++c) {
+			const AABB3f& cell = cells[c];
+			maxBand = maxBand.cwiseMax((cell.ptMax-cell.ptMin)*fBand);
+			for (const PointCloud::Index* const pEnd(pIdx+cellsSize[c]); pIdx!=pEnd; ++pIdx)
+				if (SeamDistance(bounds, cell, fBand, pointcloud.points[*pIdx]) < 2.f)
+					poolIndices.emplace_back(*pIdx);
+		}
+		std::vector<PointCloud::Index> seamCellsSize;
+		SplitPointCloud(pointcloud.points, poolIndices.data(), poolIndices.data()+poolIndices.size(),
+			BoundingCell(pointcloud.points, poolIndices.data(), poolIndices.data()+poolIndices.size()), nMaxChunkPoints, seamCells, &seamCellsSize);
+		seamRegions = seamCells;
+		for (AABB3f& region: seamRegions) {
+			region.ptMin -= maxBand;
+			region.ptMax += maxBand;
+		}
+		GatherRegions(pointcloud.points, poolIndices, seamCells, seamCellsSize, seamRegions, seamRegionsIndices);
+	}
+	indices.clear(); indices.shrink_to_fit();
+	std::vector<Chunk> chunks(cells.size()+seamCells.size());
+	for (size_t c=0; c<cells.size(); ++c) {
+		Chunk& chunk = chunks[c];
+		chunk.cell = cells[c];
+		chunk.indices.swap(regionsIndices[c]);
+		chunk.bSeam = false;
+	}
+	for (size_t s=0; s<seamCells.size(); ++s) {
+		Chunk& chunk = chunks[cells.size()+s];
+		chunk.cell = seamCells[s];
+		chunk.indices.swap(seamRegionsIndices[s]);
+		for (size_t c=0; c<cells.size(); ++c)
+			if (IsOverlapping(seamRegions[s], cells[c]))
+				chunk.cells.emplace_back((uint32_t)c);
+		chunk.bSeam = true;
+	}
+	regionsIndices.clear();
+	seamRegionsIndices.clear();
+	const int64_t nChunks((int64_t)chunks.size());
+	VERBOSE("Reconstructing the mesh in %u chunks of at most %u points (%u along the seams)", (unsigned)nChunks, nMaxChunkPoints, (unsigned)(chunks.size()-cells.size()));
+
+	// reconstruct the mesh of each chunk
+	bool bAbort(false);
+	#ifdef DELAUNAY_USE_OPENMP
+	#pragma omp parallel for schedule(dynamic) shared(bAbort)
+	#endif
+	for (int64_t c=0; c<nChunks; ++c) {
+		#ifdef DELAUNAY_USE_OPENMP
+		#pragma omp flush (bAbort)
+		#endif
+		if (bAbort)
+			continue;
+		Chunk& chunk = chunks[c];
+		Scene scene(1);
+		scene.platforms.CopyOf(platforms);
+		scene.images.CopyOf(images);
+		for (PointCloud::Index idx: chunk.indices) {
+			scene.pointcloud.points.emplace_back(pointcloud.points[idx]);
+			scene.pointcloud.pointViews.emplace_back(pointcloud.pointViews[idx]);
+			if (!pointcloud.pointWeights.empty())
+				scene.pointcloud.pointWeights.emplace_back(pointcloud.pointWeights[idx]);
+		}
+		chunk.indices.clear(); chunk.indices.shrink_to_fit();
+		if (scene.pointcloud.GetSize() < 4)
+			continue;
+		const PointCloud::Index nPoints((PointCloud::Index)scene.pointcloud.GetSize());
+		if (!reconstructChunk(scene)) {
+			bAbort = true;
+			#ifdef DELAUNAY_USE_OPENMP
+			#pragma omp flush (bAbort)
+			#endif
+			continue;
+		}
+		// keep only the faces centered inside the chunk cell, and inside or outside the seams band
+		for (const Mesh::Face& face: scene.mesh.faces) {
+			const Mesh::Vertex center((scene.mesh.vertices[face[0]]+scene.mesh.vertices[face[1]]+scene.mesh.vertices[face[2]])*(1.f/3.f));
+			if (!IsInsideCell(chunk.cell, center))
+				continue;
+			bool bInBand(false);
+			if (!chunk.bSeam) {
+				bInBand = SeamDistance(bounds, chunk.cell, fBand, center) < 1.f;
+			} else {
+				for (uint32_t idxCell: chunk.cells) {
+					if (IsInsideCell(cells[idxCell], center)) {
+						bInBand = SeamDistance(bounds, cells[idxCell], fBand, center) < 1.f;
+						break;
+					}
+				}
+			}
+			if (bInBand == chunk.bSeam)
+				chunk.mesh.faces.emplace_back(face);
+		}
+		chunk.mesh.vertices.Swap(scene.mesh.vertices);
+		DEBUG_EXTRA("Mesh %s %u reconstructed: %u points -> %u faces", chunk.bSeam ? "seam chunk" : "chunk", (unsigned)c, nPoints, chunk.mesh.faces.GetSize());
+	}
+	if (bAbort)
+		return false;
+	pointcloud.Release();
+	InvalidateImagePoints();
+
+	// stitch the chunk meshes, merging the vertices shared between them
+	struct VertexHash {
+		size_t operator()(const Mesh::Vertex& X) const {
+			const std::hash<Mesh::Vertex::Type> hasher;
+			return hasher(X.x) ^ (hasher(X.y) << 1) ^ (hasher(X.z) << 2);
+		}
+	};
+	std::unordered_map<Mesh::Vertex,Mesh::VIndex,VertexHash> mapVertices;
+	for (Chunk& chunk: chunks) {
+		Mesh& chunkMesh = chunk.mesh;
+		CLISTDEF0(Mesh::VIndex) mapChunkVertices(chunkMesh.vertices.GetSize());
+		mapChunkVertices.MemsetValue(NO_ID);
+		for (const Mesh::Face& face: chunkMesh.faces) {
+			Mesh::Face& newFace = mesh.faces.AddEmpty();
+			for (int v=0; v<3; ++v) {
+				Mesh::VIndex& idxVertex = mapChunkVertices[face[v]];
+				if (idxVertex == NO_ID) {
+					const Mesh::Vertex& X = chunkMesh.vertices[face[v]];
+					const auto pairItID(mapVertices.emplace(X, (Mesh::VIndex)mesh.vertices.GetSize()));
+					if (pairItID.second)
+						mesh.vertices.emplace_back(X);
+					idxVertex = pairItID.first->second;
+				}
+				newFace[v] = idxVertex;
+			}
+		}
+		chunkMesh.Release();
+	}
+	// fix non-manifold vertices and edges left along the seams
+	for (unsigned i=0; i<nItersFixNonManifold; ++i)
+		if (!mesh.FixNonManifold())
+			break;
+
+	DEBUG_EXTRA("Mesh chunks stitched: %u chunks -> %u vertices, %u faces (%s)", (unsigned)nChunks, mesh.vertices.GetSize(), mesh.faces.GetSize(), TD_TIMER_GET_FMT().c_str());
+	return true;
+} // ReconstructMeshChunks
+/*----------------------------------------------------------------*/